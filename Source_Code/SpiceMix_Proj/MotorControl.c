@@ -11,6 +11,7 @@
 #include "wait.h"
 #include "StepMotor.h"
 #include "Servo.h"
+#include "eepromControl.h"
 
 /*========================================================
  * Variable Definitions
@@ -23,6 +24,53 @@ int16_t HOME_OFFSET = -500;
 int16_t AUG_OFFSET = 320;
 uint16_t SVO_ENG_POS = 90;
 uint16_t SVO_DIS_POS = 160;
+uint32_t SVO_CLEAR_TIME = 400000;   // Time (us) after disengaging until the clutch is clear
+
+// Auger microsteps per half-teaspoon of each slot. Loaded
+// from the EEPROM on start-up (See initDoseCalib)
+uint16_t DOSE_USTEPS[MAXSLOTS] = {DEFAULTDOSE, DEFAULTDOSE, DEFAULTDOSE, DEFAULTDOSE,
+                                  DEFAULTDOSE, DEFAULTDOSE, DEFAULTDOSE, DEFAULTDOSE,
+                                  DEFAULTDOSE, DEFAULTDOSE, DEFAULTDOSE, DEFAULTDOSE,
+                                  DEFAULTDOSE, DEFAULTDOSE, DEFAULTDOSE, DEFAULTDOSE};
+
+// Auger speed (RPM) and ramp rate (RPM per auger rotation) of
+// each slot. Loaded from the EEPROM on start-up (See initDoseCalib)
+uint8_t AUGER_SPEED[MAXSLOTS] = {DEFAULTAUGERSPD, DEFAULTAUGERSPD, DEFAULTAUGERSPD, DEFAULTAUGERSPD,
+                                 DEFAULTAUGERSPD, DEFAULTAUGERSPD, DEFAULTAUGERSPD, DEFAULTAUGERSPD,
+                                 DEFAULTAUGERSPD, DEFAULTAUGERSPD, DEFAULTAUGERSPD, DEFAULTAUGERSPD,
+                                 DEFAULTAUGERSPD, DEFAULTAUGERSPD, DEFAULTAUGERSPD, DEFAULTAUGERSPD};
+uint8_t AUGER_RAMP[MAXSLOTS] = {DEFAULTAUGERRAMP, DEFAULTAUGERRAMP, DEFAULTAUGERRAMP, DEFAULTAUGERRAMP,
+                                DEFAULTAUGERRAMP, DEFAULTAUGERRAMP, DEFAULTAUGERRAMP, DEFAULTAUGERRAMP,
+                                DEFAULTAUGERRAMP, DEFAULTAUGERRAMP, DEFAULTAUGERRAMP, DEFAULTAUGERRAMP,
+                                DEFAULTAUGERRAMP, DEFAULTAUGERRAMP, DEFAULTAUGERRAMP, DEFAULTAUGERRAMP};
+
+// Number of carousel slots and the rack position (microsteps from
+// home) of each slot. Loaded from the EEPROM on start-up
+// (See initSlotGeometry)
+uint8_t RACK_SLOTS = DEFAULTSLOTS;
+uint16_t SLOT_USTEPS[MAXSLOTS] = {0 * RACKUSTEPREV / DEFAULTSLOTS, 1 * RACKUSTEPREV / DEFAULTSLOTS,
+                                  2 * RACKUSTEPREV / DEFAULTSLOTS, 3 * RACKUSTEPREV / DEFAULTSLOTS,
+                                  4 * RACKUSTEPREV / DEFAULTSLOTS, 5 * RACKUSTEPREV / DEFAULTSLOTS,
+                                  6 * RACKUSTEPREV / DEFAULTSLOTS, 7 * RACKUSTEPREV / DEFAULTSLOTS};
+
+// Rack speed (RPM) of slot moves. See RackTuneTrial
+uint16_t RACK_SPEED = RACKTUNEDEFSPD;
+
+// Rack Motion Profiles
+// The trapezoidal profile is used for homing since the speed is
+// changed while moving. The S-Curve profile is used for slot moves
+// and lets the loaded carousel stop without ringing, so it needs
+// a much shorter settle time.
+MotorProfileStructType RACK_TRAP_PROF = {PROFILE_TRAP, RACKSTARTQ16, RACKACCELQ16, RACKDECELQ16, RACKSETTLEUS};
+MotorProfileStructType RACK_SCURVE_PROF = {PROFILE_SCURVE, RACKSTARTQ16, RACKACCELQ16, RACKDECELQ16, 100000};
+
+// State of the non-blocking dispense sequence (See DispenseTask)
+static DispenseStructType Dispense = {DISP_IDLE, };
+
+// Set while the rack position is known, and while the state saved
+// in the EEPROM is marked clean (See SaveRackState)
+static bool rack_valid = false;
+static bool rack_saved_clean = false;
 
 
 /*========================================================
@@ -30,242 +78,1509 @@ uint16_t SVO_DIS_POS = 160;
  *========================================================
  */
 
+/* =======================================================
+ * Function Name: SaveRackState
+ * =======================================================
+ * Parameters: clean
+ * Return: None
+ * Description: This function tracks whether the rack
+ * position can be restored after a power cycle. Clean is
+ * false before the rack begins to move and true once it
+ * has stopped on its target. To limit EEPROM wear and keep
+ * blocking writes out of the dispense sequence, only the
+ * first move after the saved state was clean is written
+ * (marking it not clean). The clean state is written when
+ * the system is idle by FlushRackState.
+ * =======================================================
+ */
+static void SaveRackState(bool clean)
+{
+    RackStateStructType state;
+
+    rack_valid = clean;
+
+    if (clean || !rack_saved_clean)
+    {
+        return;
+    }
+
+    state.position = GetMotorPosition(RACK);
+    state.clean = false;
+    state.hall = GetHallInput();
+
+    // Keep the flag on a failed write so it is tried again
+    if (Write_RackState(state) == 0)
+    {
+        rack_saved_clean = false;
+    }
+}
+
+/* =======================================================
+ * Function Name: FlushRackState
+ * =======================================================
+ * Parameters: None
+ * Return: error
+ * Description: This function saves the rack position to
+ * the EEPROM as clean, if the rack position is known and
+ * has not been saved since the rack last moved. The hall
+ * sensor input at the position is saved with it, which is
+ * used to check the rack has not been moved when the state
+ * is restored. Call it when the system is idle and the
+ * rack is stopped.
+ * =======================================================
+ */
+uint16_t FlushRackState(void)
+{
+    RackStateStructType state;
+    uint16_t error = 0;
+
+    if (rack_valid && !rack_saved_clean)
+    {
+        state.position = GetMotorPosition(RACK);
+        state.clean = true;
+        state.hall = GetHallInput();
+
+        error = Write_RackState(state);
+        rack_saved_clean = (error == 0);
+    }
+
+    return error;
+}
+
+/* =======================================================
+ * Function Name: RestoreRackState
+ * =======================================================
+ * Parameters: None
+ * Return: valid
+ * Description: This function restores the rack position
+ * saved in the EEPROM at start-up so the rack does not
+ * have to be homed again. The saved state is only used if
+ * its checksum is valid, the last rack move completed and
+ * the hall sensors read the same as when it was saved.
+ * Returns false if the rack must be homed.
+ * =======================================================
+ */
+bool RestoreRackState(void)
+{
+    RackStateStructType state;
+
+    rack_valid = false;
+    rack_saved_clean = false;
+
+    if (Read_RackState(&state) != 0 || !state.clean)
+    {
+        return false;
+    }
+
+    rack_saved_clean = true;
+
+    if (state.hall != GetHallInput())
+    {
+        return false;
+    }
+
+    SetMotorPosition(RACK, state.position);
+    rack_pos = ((((state.position % RACKUSTEPREV) + RACKUSTEPREV) % RACKUSTEPREV) * 360) / RACKUSTEPREV;
+    rack_valid = true;
+
+    return true;
+}
+
+/* =======================================================
+ * Function Name: IsRackPositionValid
+ * =======================================================
+ * Parameters: None
+ * Return: valid
+ * Description: This is a helper function to check if the
+ * rack position is known, it is false before the rack has
+ * been homed or restored and after a failed homing.
+ * =======================================================
+ */
+bool IsRackPositionValid(void)
+{
+    return rack_valid;
+}
+
 /* =======================================================
  * Function Name: StepRackHome
  * =======================================================
  * Parameters: None
  * Return: None
  * Description: This function performs the homing of the
- * main rack. The rack motor is commanded to turn until
- * the hall sensors located at the home position, indicate
- * the rack is "home". The home_status state is set from
- * the hall sensor interrupt. As the rack approaches home,
- * the rack will be slowed until both sensors indicate
- * home. In the event home is never indicated, an
+ * main rack in two passes. The home position is defined by
+ * the edge where the hall sensors first indicate "home"
+ * while the rack turns CW.
+ * The fast seek turns the rack towards the home edge using
+ * the shortest direction from the last known position (CW
+ * after start-up) and stops as soon as the hall sensor
+ * interrupt latches the home edge. The rack then backs up
+ * to just before the edge and approaches it again slowly
+ * CW so the edge is latched at a low, repeatable speed.
+ * The rack position is counted relative to the latched
+ * edge, so the stopping distance does not affect the
+ * result. In the event the home edge is never found, an
  * "HOME FAIL" error code will be returned
  * =======================================================
  */
 uint16_t StepRackHome(void)
 {
-    MotorHomeStatEnumType home_status = NOTHOME;
-    MotorRunStatEnumType run_status = RUNNING;
-    bool nearhome_pv = false;
+    MotionHandleType move;
+    uint32_t count = 0;
+    int32_t edge = 0;
+    int32_t seek = HOMESEEKDIST;
+    int32_t backoff = HOMEMARGIN;
 
-    home_status = GetMotorHomeStatus(RACK);
-
-    if (home_status != HOME)
-    {
-        // Command the Rack Motor to make 3 full rotations
-        CommandMotor(RACK, (USTEPFULL360 * 3 * GEARRATIO), 10);
+    SetMotorProfile(RACK, &RACK_TRAP_PROF);
+    SaveRackState(false);
 
-        run_status = GetMotorRunStatus(RACK);
-        waitMicrosecond(1000);  // Wait atleast 1ms to allow motor to start running
+    // The hall sensor edges are learnt again relative to the new home
+    ResetHallRef();
 
-        while (home_status != HOME && run_status != HALTED)
+    // Read the sensors directly. The home status is only updated on
+    // a hall edge so it is stale after a reset or a restored position
+    if (GetHallInput() == 0)
+    {
+        // Already home, the edge is somewhere CCW of the rack
+        edge = GetMotorPosition(RACK);
+        backoff = 2 * HOMEMARGIN;
+    }
+    else
+    {
+        // Seek towards where the home edge was last seen
+        if (RackDelta(-HOME_OFFSET) < 0)
         {
-            home_status = GetMotorHomeStatus(RACK);
-            run_status = GetMotorRunStatus(RACK);
-            
-            // If Approaching Home position slow down.
-            if (home_status == NEARHOME)
-            {
-                // If first transition to near home slow down the motor
-                if (nearhome_pv == false)
-                {
-                    SetMotorSpd(RACK, 6);
-                    nearhome_pv = true;
-                }
-            }
-            else
-            {
-                // If first transition out of near home, increase speed
-                if (nearhome_pv == true)
-                {
-                    SetMotorSpd(RACK, 10);
-                    nearhome_pv = 0;
-                }
-            }
+            seek = -HOMESEEKDIST;
+
+            // The edge latched moving CCW is on the far side of
+            // the home position, back up further to clear it
+            backoff = 2 * HOMEMARGIN;
         }
 
-        if (home_status == HOME)
-        {
+        count = GetHallHomeLatch(&edge);
+        move = CommandMotor(RACK, seek, HOMESEEKSPD);
 
-            waitMicrosecond(100000);  // Wait atleast 1ms to allow motor to start running
-            CommandMotor(RACK, HOME_OFFSET, 6);
-            //TurnOffMotor(RACK);
-            // Reset Rack position to 0 (Home);
-            rack_pos = 0;
-        }
-        else
+        while (GetHallHomeLatch(&edge) == count && !IsMotionDone(move));
+
+        if (GetHallHomeLatch(&edge) == count)
         {
-            // Failed to find home before Motor Timeout
-            if (run_status == HALTED)
-            {
-                run_status = FAILED;
-                return ERRORHOMEFAIL;
-            }
+            // Failed to find home before the end of the seek
+            SaveRackState(false);
+            return ERRORHOMEFAIL;
         }
+
+        StopMotorMove(RACK);
+        WaitMotion(move);
+    }
+
+    // Back up to just before the home edge
+    waitMicrosecond(HOMEREVERSEUS);
+    WaitMotion(CommandMotor(RACK, (edge - backoff) - GetMotorPosition(RACK), HOMESEEKSPD));
+    waitMicrosecond(HOMEREVERSEUS);
+
+    // Approach the edge slowly CW and latch it again
+    ResetHallRef();
+    count = GetHallHomeLatch(&edge);
+    move = CommandMotor(RACK, 2 * backoff, HOMEAPPROACHSPD);
+
+    while (GetHallHomeLatch(&edge) == count && !IsMotionDone(move));
+
+    if (GetHallHomeLatch(&edge) == count)
+    {
+        SaveRackState(false);
+        return ERRORHOMEFAIL;
     }
 
-    // Reset Rack Motor Speed to default
-    SetMotorSpd(RACK, 20);
+    StopMotorMove(RACK);
+    WaitMotion(move);
+
+    // Move to the home offset from the edge and make it position 0
+    WaitMotion(CommandMotor(RACK, (edge + HOME_OFFSET) - GetMotorPosition(RACK), HOMEAPPROACHSPD));
+    SetMotorPosition(RACK, GetMotorPosition(RACK) - (edge + HOME_OFFSET));
+    rack_pos = 0;
+    SaveRackState(true);
 
     return 0;
 }
 
 /* =======================================================
- * Function Name: SetRackPos
+ * Function Name: RackDelta
  * =======================================================
- * Parameters: pos
+ * Parameters: target
+ * Return: microsteps
+ * Description: This function calculates the shortest
+ * signed move (in microsteps) from the current absolute
+ * rack position to the given target position on the ring.
+ * Positive is CW. The rack position is tracked as an
+ * integer so no fractional steps are lost between moves.
+ * =======================================================
+ */
+int32_t RackDelta(int32_t target)
+{
+    return RackDeltaFrom(GetMotorPosition(RACK), target);
+}
+
+/* =======================================================
+ * Function Name: RackDeltaFrom
+ * =======================================================
+ * Parameters: rack, target
+ * Return: microsteps
+ * Description: This function calculates the shortest
+ * signed move (in microsteps) from the given rack
+ * position to the target position on the ring. Positive
+ * is CW. See RackDelta.
+ * =======================================================
+ */
+int32_t RackDeltaFrom(int32_t rack, int32_t target)
+{
+    int32_t delta = (target - rack) % RACKUSTEPREV;
+
+    // Calculate shortest distance
+    if (delta > RACKUSTEPREV / 2)
+    {
+        // Subtract a revolution to obtain CCW command
+        delta = delta - RACKUSTEPREV;
+    }
+    else if (delta < -(RACKUSTEPREV / 2))
+    {
+        // Add a revolution to obtain CW command
+        delta = delta + RACKUSTEPREV;
+    }
+
+    return delta;
+}
+
+/* =======================================================
+ * Function Name: SetRackSlots
+ * =======================================================
+ * Parameters: slots
  * Return: None
- * Description: This function will command the rack motor
- * to turn the rack to a specified position. Based on
- * the given position (0-7) the angle and corresponding
- * commanded steps is calculated. The function will
- * wait for the motor to execute and will return once
- * all steps have been executed.
+ * Description: This function sets the number of slots of
+ * the carousel (2 to MAXSLOTS). The slots are evenly
+ * spaced until their angles are calibrated with
+ * SetSlotAngle.
  * =======================================================
  */
-void SetRackPos(uint16_t pos)
+void SetRackSlots(uint8_t slots)
 {
-    MotorRunStatEnumType status = OFF;
-    uint16_t angle = 0;
+    uint8_t i = 0;
 
-    // Limit Position input
-    if (pos > 7)
+    if (slots < 2)
+    {
+        slots = 2;
+    }
+    else if (slots > MAXSLOTS)
     {
-        pos = 7;
+        slots = MAXSLOTS;
     }
 
-    // Calculate the required angle
-    angle = pos*45;
+    RACK_SLOTS = slots;
 
-    // Calculate position difference
-    float delta = angle - rack_pos;
+    for (i = 0; i < MAXSLOTS; i++)
+    {
+        SLOT_USTEPS[i] = (i < slots) ? ((uint32_t) i * RACKUSTEPREV) / slots : 0;
+    }
+}
 
-    // Store new position
-    rack_pos = angle;
+/* =======================================================
+ * Function Name: SetSlotAngle
+ * =======================================================
+ * Parameters: position, microsteps
+ * Return: None
+ * Description: This function sets the rack position of a
+ * slot in microsteps CW from home, so an unevenly spaced
+ * slot can be corrected. SLOTANGLENONE returns the slot
+ * to its evenly spaced position.
+ * =======================================================
+ */
+void SetSlotAngle(uint8_t position, uint16_t microsteps)
+{
+    if (position > RACK_SLOTS - 1)
+    {
+        return;
+    }
 
-    // Calculate shortest distance
-    if(delta > 180)
+    if (microsteps == SLOTANGLENONE)
     {
-        // Subtract 360 to obtain CCW command
-        delta = delta - 360;
+        SLOT_USTEPS[position] = ((uint32_t) position * RACKUSTEPREV) / RACK_SLOTS;
     }
     else
     {
-        if (delta < -180)
-        {
-            // Add 360 to obtain CW command
-            delta = delta + 360;
-        }
+        SLOT_USTEPS[position] = microsteps % RACKUSTEPREV;
     }
+}
 
-    // Convert angle to microsteps
-    // NOTE: This will be multiplied by some gain
-    // factor for the gear ratio
-    int32_t microsteps = (int32_t) (delta/MICROSTEPSF)* GEARRATIO;
+/* =======================================================
+ * Function Name: SlotDistance
+ * =======================================================
+ * Parameters: rack, position
+ * Return: microsteps
+ * Description: This function returns the length of the
+ * shortest rack move from the given rack position to a
+ * slot. This is used to pick the nearest of several slots
+ * holding the same spice.
+ * =======================================================
+ */
+uint32_t SlotDistance(int32_t rack, uint8_t position)
+{
+    int32_t delta = RackDeltaFrom(rack, SLOT_USTEPS[position]);
 
-    // Command the new position
-    CommandMotor(RACK, microsteps, 30);
+    return (delta < 0) ? -delta : delta;
+}
+
+/* =======================================================
+ * Function Name: StartRackPos
+ * =======================================================
+ * Parameters: pos
+ * Return: handle
+ * Description: This function will command the rack motor
+ * to turn the rack to a specified position. Based on
+ * the given slot (0 to RACK_SLOTS-1) the target microstep
+ * is looked up and the shortest move to it is calculated.
+ * The function does not wait for the move, a handle to the
+ * move is returned instead. The caller is responsible for
+ * allowing the rack settle time once the move has
+ * completed.
+ * =======================================================
+ */
+MotionHandleType StartRackPos(uint16_t pos)
+{
+    int32_t delta = 0;
 
-    while (status != HALTED)
+    // Limit Position input
+    if (pos > RACK_SLOTS - 1)
+    {
+        pos = RACK_SLOTS - 1;
+    }
+
+    // Store new position (Angle)
+    rack_pos = ((uint32_t) SLOT_USTEPS[pos] * 360) / RACKUSTEPREV;
+    delta = RackDelta(SLOT_USTEPS[pos]);
+
+    // The saved position is not valid while the rack is moving
+    if (delta != 0)
     {
-        status = GetMotorRunStatus(RACK);
+        SaveRackState(false);
     }
 
-    //Wait half a second to let motor come to a full stop
-    waitMicrosecond(500000);
+    // Command the new position
+    SetMotorProfile(RACK, &RACK_SCURVE_PROF);
+    return CommandMotor(RACK, delta, RACK_SPEED);
 }
 
 /* =======================================================
- * Function Name: SetAugerPos
+ * Function Name: SetRackPos
  * =======================================================
- * Parameters: rotations
+ * Parameters: pos
  * Return: None
- * Description: This function commands the auger motor
- * to rotate a specified amount of full rotations.
- * The function will wait for the motor to complete
- * its command and will return once all steps have been
- * executed.
+ * Description: This function will command the rack motor
+ * to turn the rack to a specified position. The function
+ * will wait for the motor to execute and the rack to
+ * settle and will return once all steps have been
+ * executed. See StartRackPos.
  * =======================================================
  */
-void SetAugerPos(uint16_t rotations)
+void SetRackPos(uint16_t pos)
 {
-    MotorRunStatEnumType status = OFF;
+    WaitMotion(StartRackPos(pos));
 
-    // Calculate position difference
-    float delta = 360*rotations;
+    // Wait for the rack to come to a full stop
+    waitMicrosecond(GetMotorSettleTime(RACK));
+    SaveRackState(true);
+}
 
-    // Convert angle to microsteps
-    int32_t microsteps = (int32_t) delta/MICROSTEPSF;
+/* =======================================================
+ * Function Name: SetRackTune
+ * =======================================================
+ * Parameters: speed, accel
+ * Return: None
+ * Description: This function sets the speed (RPM) and the
+ * acceleration (Q16 RPM per microstep) used for rack slot
+ * moves. The deceleration is set to match.
+ * =======================================================
+ */
+void SetRackTune(uint16_t speed, uint32_t accel)
+{
+    RACK_SPEED = speed;
+    RACK_SCURVE_PROF.accel = accel;
+    RACK_SCURVE_PROF.decel = accel;
+}
 
-    // Rotate some additional steps to offset the auger screw for
-    // the next load.
-    microsteps = microsteps + AUG_OFFSET;
-    CommandMotor(AUGER, microsteps, 35);
+/* =======================================================
+ * Function Name: RackTuneReference
+ * =======================================================
+ * Parameters: None
+ * Return: None
+ * Description: This function prepares the rack for the
+ * tune trials. The rack is turned one slow revolution in
+ * each direction so every hall sensor edge is learnt at a
+ * speed where no steps are lost. The rack must be homed.
+ * =======================================================
+ */
+void RackTuneReference(void)
+{
+    SetMotorProfile(RACK, &RACK_TRAP_PROF);
+    SaveRackState(false);
+    ResetHallRef();
+
+    WaitMotion(CommandMotor(RACK, RACKUSTEPREV, RACKTUNEREFSPD));
+    waitMicrosecond(HOMEREVERSEUS);
+    WaitMotion(CommandMotor(RACK, -RACKUSTEPREV, RACKTUNEREFSPD));
+    waitMicrosecond(HOMEREVERSEUS);
+
+    ClearHallMaxError();
+    SaveRackState(true);
+}
+
+/* =======================================================
+ * Function Name: RackTuneTrial
+ * =======================================================
+ * Parameters: speed, accel
+ * Return: maxerror (microsteps)
+ * Description: This function runs one auto-tune trial.
+ * The rack is turned one revolution in each direction with
+ * the slot move profile at the given speed and accel, and
+ * the largest error seen at the learnt hall sensor edges
+ * is returned. An error above RACKTUNEMAXERR means steps
+ * were lost, in which case the rack position is no longer
+ * trusted and the rack must be homed again. See
+ * RackTuneReference.
+ * =======================================================
+ */
+uint32_t RackTuneTrial(uint16_t speed, uint32_t accel)
+{
+    MotorProfileStructType profile = RACK_SCURVE_PROF;
+    uint32_t maxerror = 0;
+
+    profile.accel = accel;
+    profile.decel = accel;
+    SetMotorProfile(RACK, &profile);
+    SaveRackState(false);
+    ClearHallMaxError();
+
+    WaitMotion(CommandMotor(RACK, RACKUSTEPREV, speed));
+    waitMicrosecond(profile.settle);
+    WaitMotion(CommandMotor(RACK, -RACKUSTEPREV, speed));
+    waitMicrosecond(profile.settle);
+
+    maxerror = ClearHallMaxError();
+    SaveRackState(maxerror <= RACKTUNEMAXERR);
 
-    while (status != HALTED)
+    return maxerror;
+}
+
+/* =======================================================
+ * Function Name: DoseSteps
+ * =======================================================
+ * Parameters: position, quantity
+ * Return: microsteps
+ * Description: This function converts a quantity in
+ * half-teaspoons of the spice in the given slot into
+ * auger microsteps using the dose calibration of the slot.
+ * =======================================================
+ */
+uint32_t DoseSteps(uint8_t position, uint16_t quantity)
+{
+    if (position > MAXSLOTS - 1)
     {
-        status = GetMotorRunStatus(AUGER);
+        position = MAXSLOTS - 1;
     }
 
-    // De-energize the Auger Motor after moving since it
-    // does not need to be held in place
-    TurnOffMotor(AUGER);
+    return (uint32_t) quantity * DOSE_USTEPS[position];
+}
 
-    //Wait 10ms for motor to come to a stop
-    waitMicrosecond(10000);
+/* =======================================================
+ * Function Name: AugerPhase
+ * =======================================================
+ * Parameters: None
+ * Return: microsteps
+ * Description: This function returns the position of the
+ * auger drive within one rotation, measured CW from the
+ * parked position (0 to AUGERUSTEPREV-1). The clutch
+ * engages a spice holder with the drive parked. Every
+ * dose leaves the drive AUG_OFFSET past the park position,
+ * so the screw of the holder is offset for its next load.
+ * The drive is parked again before the next engagement and
+ * once dispensing is done (See DispenseFlush).
+ * The phase is taken from the step count of the motor so
+ * it is also known after a move was interrupted.
+ * =======================================================
+ */
+int32_t AugerPhase(void)
+{
+    int32_t phase = GetMotorPosition(AUGER) % AUGERUSTEPREV;
+
+    if (phase < 0)
+    {
+        phase = phase + AUGERUSTEPREV;
+    }
+
+    return phase;
 }
 
 /* =======================================================
- * Function Name: TestMotors
+ * Function Name: ParkAuger
  * =======================================================
  * Parameters: None
- * Return: None
- * Description: This function is debugging only and allows
- * for testing of the motrs and the hardware.
- * A breakpoint can be used to set the desired position
- * and rotation arguments.
+ * Return: handle
+ * Description: This function queues the shortest move
+ * that returns the auger drive to its parked position.
+ * It must only be called while the clutch is disengaged.
+ * Nothing is moved if the drive is already parked, in
+ * which case the returned handle is already done.
  * =======================================================
  */
-void TestMotors(void)
+MotionHandleType ParkAuger(void)
 {
+    MotionHandleType handle = {AUGER, MOTIONINVALID};
+    int32_t delta = -AugerPhase();
 
+    if (delta < -(AUGERUSTEPREV / 2))
+    {
+        delta = delta + AUGERUSTEPREV;
+    }
 
+    if (delta != 0)
+    {
+        handle = QueueMotorSegment(AUGER, delta, AUGPARKSPD, 0, 0);
+    }
 
+    return handle;
 }
 
 /* =======================================================
- * Function Name: DispenseSequence
+ * Function Name: AugerSlotProfile
  * =======================================================
- * Parameters: position, quantity
- * Return: None
- * Description: This function will execute the dispense
- * sequence for the spice rack. This includes calls
- * to for setting the rack position, engaging/disengaging
- * the servo clutch, and turning the auger motor.
- * position is a specified slot on the rack. quantity
- * is the amount of half teaspoons.
+ * Parameters: position
+ * Return: profile
+ * Description: Helper function to build the auger motion
+ * profile of the spice in the given slot. See
+ * SetAugerProfile.
  * =======================================================
  */
-void DispenseSequence(uint8_t position, uint16_t quantity)
+static MotorProfileStructType AugerSlotProfile(uint8_t position)
 {
-    MotorRunStatEnumType status = OFF;
-    SetRackPos(position);
-    SetServoPos(SVO_ENG_POS);
-    SetAugerPos(quantity);
-    SetServoPos(SVO_DIS_POS);
-    CommandMotor(AUGER, -AUG_OFFSET, 35);
+    MotorProfileStructType profile = {PROFILE_TRAP, AUGERSTARTQ16, AUGERACCELQ16, AUGERDECELQ16, AUGERSETTLEUS};
 
-    while (status != HALTED)
+    if (position > MAXSLOTS - 1)
     {
-        status = GetMotorRunStatus(AUGER);
+        position = MAXSLOTS - 1;
     }
 
-    // De-energize the Auger Motor after moving since it
-    // does not need to be held in place
-    TurnOffMotor(AUGER);
+    if (AUGER_RAMP[position] != 0)
+    {
+        profile.accel = ((uint32_t) AUGER_RAMP[position] << 16) / AUGERUSTEPREV;
+        profile.decel = profile.accel;
+    }
+
+    return profile;
+}
+
+/* =======================================================
+ * Function Name: SetAugerProfile
+ * =======================================================
+ * Parameters: position
+ * Return: None
+ * Description: This function selects the auger motion
+ * profile for the spice in the given slot. The ramp rate
+ * of the slot (RPM per auger rotation) is converted to the
+ * speed change per microstep used by the step interrupt.
+ * Must not be called while the auger is moving.
+ * =======================================================
+ */
+void SetAugerProfile(uint8_t position)
+{
+    MotorProfileStructType profile = AugerSlotProfile(position);
+
+    SetMotorProfile(AUGER, &profile);
 }
 
+/* =======================================================
+ * Function Name: StartAugerPos
+ * =======================================================
+ * Parameters: microsteps, speed
+ * Return: handle
+ * Description: This function commands the auger motor
+ * to rotate a specified amount of microsteps plus the
+ * auger offset at the given speed (RPM). The drive must be
+ * parked before the clutch is engaged (See ParkAuger).
+ * The function does not wait for the move, a handle to
+ * the move is returned instead.
+ * =======================================================
+ */
+MotionHandleType StartAugerPos(uint32_t microsteps, uint16_t speed)
+{
+    if (speed > AUGERMAXSPD)
+    {
+        speed = AUGERMAXSPD;
+    }
+
+    // Rotate some additional steps to offset the auger screw for
+    // the next load.
+    return QueueMotorSegment(AUGER, (int32_t) microsteps + AUG_OFFSET, speed, 0, 0);
+}
+
+/* =======================================================
+ * Function Name: SetAugerPos
+ * =======================================================
+ * Parameters: microsteps, speed
+ * Return: None
+ * Description: This function commands the auger motor
+ * to rotate a specified amount of microsteps.
+ * The function will wait for the motor to complete
+ * its command and will return once all steps have been
+ * executed.
+ * =======================================================
+ */
+void SetAugerPos(uint32_t microsteps, uint16_t speed)
+{
+    WaitMotion(StartAugerPos(microsteps, speed));
+
+    // De-energize the Auger Motor after moving since it
+    // does not need to be held in place
+    TurnOffMotor(AUGER);
+
+    // Wait for motor to come to a stop
+    waitMicrosecond(GetMotorSettleTime(AUGER));
+}
+
+/* =======================================================
+ * Function Name: TestMotors
+ * =======================================================
+ * Parameters: None
+ * Return: None
+ * Description: This function is debugging only and allows
+ * for testing of the motrs and the hardware.
+ * A breakpoint can be used to set the desired position
+ * and rotation arguments.
+ * =======================================================
+ */
+void TestMotors(void)
+{
+
+
+
+}
+
+/* =======================================================
+ * Function Name: SetDispensePipeline
+ * =======================================================
+ * Parameters: enable
+ * Return: None
+ * Description: This function selects between the serial
+ * and the pipelined dispense sequence. In the pipelined
+ * mode a dispense is reported as done as soon as the
+ * clutch has been commanded to disengage. The rack
+ * move of the next dispense starts once the clutch is
+ * clear of the spice holder (SVO_CLEAR_TIME) instead of
+ * after the full servo move. DispenseFlush must be called
+ * after the last dispense to let the release complete.
+ * =======================================================
+ */
+void SetDispensePipeline(bool enable)
+{
+    Dispense.pipelined = enable;
+}
+
+/* =======================================================
+ * Function Name: ReleaseClutch
+ * =======================================================
+ * Parameters: None
+ * Return: None
+ * Description: Helper function to command the clutch to
+ * disengage. The rack may move once the clutch is clear
+ * (Dispense.clear) and the release is complete once the
+ * servo has reached its position (Dispense.released).
+ * =======================================================
+ */
+static void ReleaseClutch(void)
+{
+    Dispense.released = StartServoPos(SVO_DIS_POS);
+    Dispense.clear = GetTimeBase() + UStoTICKS(SVO_CLEAR_TIME);
+    Dispense.releasing = true;
+
+    // The clutch is clear no later than the end of the release
+    if ((int32_t) (Dispense.clear - Dispense.released) > 0)
+    {
+        Dispense.clear = Dispense.released;
+    }
+    Dispense.engaged = false;
+}
+
+/* =======================================================
+ * Function Name: InitDispense
+ * =======================================================
+ * Parameters: None
+ * Return: None
+ * Description: This function releases the clutch at
+ * start-up, as a reset may leave it engaged. Only the
+ * clutch clear time is waited for so the rack may move.
+ * The servo position before the release is unknown, so it
+ * is timed over the full range (See ServoMoveUS) and the
+ * first dispense waits for it before engaging.
+ * =======================================================
+ */
+void InitDispense(void)
+{
+    ReleaseClutch();
+    Dispense.startup = true;
+
+    WaitUntil(Dispense.clear);
+}
+
+/* =======================================================
+ * Function Name: BeginDispense
+ * =======================================================
+ * Parameters: position, microsteps, hold
+ * Return: started
+ * Description: Helper function to start a dispense, see
+ * StartDispense. Hold keeps the clutch engaged after the
+ * dose for a following dose from the same slot. A dose
+ * from the slot the clutch was held on skips straight to
+ * the auger move.
+ * =======================================================
+ */
+static bool BeginDispense(uint8_t position, uint32_t microsteps, bool hold)
+{
+    if (Dispense.state != DISP_IDLE || position > RACK_SLOTS - 1)
+    {
+        return false;
+    }
+
+    // A held clutch must be released before the rack moves
+    if (Dispense.engaged && position != Dispense.position)
+    {
+        ReleaseClutch();
+    }
+
+    Dispense.position = position;
+    Dispense.steps = microsteps;
+    Dispense.hold = hold;
+
+    if (Dispense.engaged)
+    {
+        // Still engaged on this slot, so dose right away
+        Dispense.deadline = GetTimeBase();
+        Dispense.state = DISP_ENGAGE;
+    }
+    else
+    {
+        Dispense.state = DISP_CLEAR;
+    }
+
+    // Start the rack right away if the clutch is already clear
+    DispenseTask();
+
+    return true;
+}
+
+/* =======================================================
+ * Function Name: StartDispense
+ * =======================================================
+ * Parameters: position, quantity
+ * Return: started
+ * Description: This function will begin the dispense
+ * sequence for the spice rack without waiting for it to
+ * complete. The sequence is advanced by calling
+ * DispenseTask until it reports the dispense is done.
+ * position is a specified slot on the rack. quantity
+ * is the amount of half teaspoons. False is returned if a
+ * dispense is already in progress or the slot is not on
+ * the carousel.
+ * =======================================================
+ */
+bool StartDispense(uint8_t position, uint16_t quantity)
+{
+    return StartDispenseSteps(position, DoseSteps(position, quantity));
+}
+
+/* =======================================================
+ * Function Name: StartDispenseSteps
+ * =======================================================
+ * Parameters: position, microsteps
+ * Return: started
+ * Description: This function begins a dispense of the
+ * given number of auger microsteps instead of a calibrated
+ * quantity, see StartDispense. This is used to measure the
+ * dose calibration of a slot.
+ * =======================================================
+ */
+bool StartDispenseSteps(uint8_t position, uint32_t microsteps)
+{
+    return BeginDispense(position, microsteps, false);
+}
+
+/* =======================================================
+ * Function Name: StartDispenseNext
+ * =======================================================
+ * Parameters: position, quantity, next
+ * Return: started
+ * Description: This function begins a dispense in the
+ * same way as StartDispense, given the slot of the dose
+ * that follows it (DISPNEXTNONE if it is the last). If the
+ * next dose comes from the same slot the rack does not
+ * need to move, so the clutch is kept engaged and the
+ * next dose starts turning the auger right away. This
+ * saves the servo release and engage of each coalesced
+ * dose.
+ * =======================================================
+ */
+bool StartDispenseNext(uint8_t position, uint16_t quantity, uint8_t next)
+{
+    return BeginDispense(position, DoseSteps(position, quantity), next == position);
+}
+
+/* =======================================================
+ * Function Name: DispenseTask
+ * =======================================================
+ * Parameters: None
+ * Return: done
+ * Description: This function advances the dispense
+ * sequence started by StartDispense. It never blocks,
+ * each call checks if the current step of the sequence
+ * has completed and starts the next one. This includes
+ * setting the rack position, engaging/disengaging
+ * the servo clutch, and turning the auger motor.
+ * The following interlocks are always enforced:
+ * - The rack only moves once the clutch is clear.
+ * - The clutch only engages once the rack has settled
+ *   and the auger drive has been parked.
+ * - The auger only doses once the clutch is engaged.
+ * True is returned once the sequence is complete (or if
+ * no dispense is in progress).
+ * =======================================================
+ */
+bool DispenseTask(void)
+{
+    // De-energize the Auger Motor once it has stopped since
+    // it does not need to be held in place
+    if (Dispense.auger_on && IsMotionDone(Dispense.auger))
+    {
+        TurnOffMotor(AUGER);
+        Dispense.auger_on = false;
+    }
+
+    // Clear the release once the servo has fully disengaged
+    if (Dispense.releasing && TimeBaseExpired(Dispense.released))
+    {
+        Dispense.releasing = false;
+        Dispense.startup = false;
+    }
+
+    switch (Dispense.state)
+    {
+    case DISP_CLEAR:
+        // Never rotate the rack until the clutch is clear
+        if (!Dispense.releasing || TimeBaseExpired(Dispense.clear))
+        {
+            Dispense.move = StartRackPos(Dispense.position);
+
+            // Park the auger drive from the previous dose while the
+            // rack moves, it is left running only if not parked
+            if (AugerPhase() != 0)
+            {
+                Dispense.auger = ParkAuger();
+                Dispense.auger_on = true;
+            }
+
+            Dispense.state = DISP_RACK;
+        }
+        break;
+    case DISP_RACK:
+        if (IsMotionDone(Dispense.move))
+        {
+            SaveRackState(true);
+
+            // Let the rack come to a full stop
+            Dispense.deadline = GetTimeBase() + UStoTICKS(GetMotorSettleTime(RACK));
+            Dispense.state = DISP_SETTLE;
+        }
+        break;
+    case DISP_SETTLE:
+        // The auger must be parked before the clutch couples it
+        // to the next spice holder. After start-up the release
+        // must also be complete (See InitDispense)
+        if (TimeBaseExpired(Dispense.deadline) && !Dispense.auger_on && !Dispense.startup)
+        {
+            Dispense.deadline = StartServoPos(SVO_ENG_POS);
+            Dispense.releasing = false;
+            Dispense.state = DISP_ENGAGE;
+        }
+        break;
+    case DISP_ENGAGE:
+        if (TimeBaseExpired(Dispense.deadline))
+        {
+            Dispense.engaged = true;
+
+            // The dose is the only auger move of the dispense. The
+            // drive is left past the park position and is parked on
+            // the next rack move (See ParkAuger). A held dose leaves
+            // the offset to the last dose from the slot.
+            SetAugerProfile(Dispense.position);
+
+            if (Dispense.hold)
+            {
+                Dispense.move = QueueMotorSegment(AUGER, (int32_t) Dispense.steps, AUGER_SPEED[Dispense.position], 0, 0);
+            }
+            else
+            {
+                Dispense.move = StartAugerPos(Dispense.steps, AUGER_SPEED[Dispense.position]);
+            }
+
+            Dispense.auger = Dispense.move;
+            Dispense.auger_on = true;
+            Dispense.state = DISP_AUGER;
+        }
+        break;
+    case DISP_AUGER:
+        // Release the clutch as soon as the dispense rotation is done,
+        // unless the next dose is from the same slot
+        if (IsMotionDone(Dispense.move))
+        {
+            if (Dispense.hold)
+            {
+                Dispense.state = DISP_IDLE;
+                break;
+            }
+
+            ReleaseClutch();
+
+            if (Dispense.pipelined)
+            {
+                Dispense.state = DISP_IDLE;
+            }
+            else
+            {
+                Dispense.state = DISP_RELEASE;
+            }
+        }
+        break;
+    case DISP_RELEASE:
+        if (!Dispense.auger_on && !Dispense.releasing)
+        {
+            Dispense.state = DISP_IDLE;
+        }
+        break;
+    case DISP_IDLE:
+    default:
+        break;
+    }
+
+    return Dispense.state == DISP_IDLE;
+}
+
+/* =======================================================
+ * Function Name: DispenseFlush
+ * =======================================================
+ * Parameters: None
+ * Return: None
+ * Description: This function waits for any dispense in
+ * progress to complete, including the clutch release
+ * that the pipelined mode leaves running. The auger drive
+ * is then parked, as its phase is lost on a reset or
+ * power cycle (See AugerPhase).
+ * =======================================================
+ */
+void DispenseFlush(void)
+{
+    while (!DispenseTask() || Dispense.auger_on || Dispense.releasing);
+
+    // Never leave the clutch held once dispensing is done
+    if (Dispense.engaged)
+    {
+        ReleaseClutch();
+
+        while (Dispense.releasing)
+        {
+            DispenseTask();
+        }
+    }
+
+    // The phase is only known while powered, so never leave the
+    // drive off the park position once the clutch is clear
+    if (AugerPhase() != 0)
+    {
+        Dispense.auger = ParkAuger();
+        Dispense.auger_on = true;
+
+        while (Dispense.auger_on)
+        {
+            DispenseTask();
+        }
+    }
+}
+
+/* =======================================================
+ * Function Name: DispenseSequence
+ * =======================================================
+ * Parameters: position, quantity
+ * Return: None
+ * Description: This function will execute the dispense
+ * sequence for the spice rack and wait for it to complete.
+ * See StartDispense and DispenseTask.
+ * position is a specified slot on the rack. quantity
+ * is the amount of half teaspoons.
+ * =======================================================
+ */
+void DispenseSequence(uint8_t position, uint16_t quantity)
+{
+    StartDispense(position, quantity);
+    DispenseFlush();
+}
+
+/* =======================================================
+ * Function Name: RampTimeUS
+ * =======================================================
+ * Parameters: mode, from, to, steps
+ * Return: time (microseconds)
+ * Description: Helper function for the dispense time
+ * estimate. Adds up the step periods of a ramp from one
+ * speed to another (RPM) over the given number of steps,
+ * following the same shape as the ramp generator of the
+ * step interrupts (See RampNextSpeed).
+ * =======================================================
+ */
+static float RampTimeUS(MotorProfileModeEnumType mode, float from, float to, uint32_t steps)
+{
+    float time = 0;
+    float frac = 0;
+    float speed = 0;
+    uint32_t chunk = (steps + RAMPESTSAMPLES - 1) / RAMPESTSAMPLES;
+    uint32_t i = 0;
+
+    // Long ramps are added up in chunks of steps, using the
+    // speed at the middle of each chunk
+    for (i = 0; i < steps; i += chunk)
+    {
+        if (chunk > steps - i)
+        {
+            chunk = steps - i;
+        }
+
+        frac = (i + chunk / 2.0f) / steps;
+
+        if (mode == PROFILE_SCURVE)
+        {
+            frac = frac * frac * (3 - 2 * frac);
+        }
+
+        speed = from + (to - from) * frac;
+        if (speed < MINRPM)
+        {
+            speed = MINRPM;
+        }
+
+        time += chunk * STEPPERIODUS / speed;
+    }
+
+    return time;
+}
+
+/* =======================================================
+ * Function Name: EstimateMoveUS
+ * =======================================================
+ * Parameters: profile, speed, steps
+ * Return: time (microseconds)
+ * Description: This function predicts how long a move of
+ * the given number of microsteps takes with a motion
+ * profile and commanded speed (RPM). The move accelerates
+ * from the profile start speed, cruises and decelerates
+ * back to the start speed. If the move is too short to
+ * reach the commanded speed, it turns around at the speed
+ * where the accel and decel distances meet, in the same
+ * way as the ramp generator.
+ * =======================================================
+ */
+uint32_t EstimateMoveUS(const MotorProfileStructType* profile, uint16_t speed, uint32_t steps)
+{
+    float start = (float) profile->start / 65536;
+    float accel = (float) profile->accel / 65536;
+    float decel = (float) profile->decel / 65536;
+    float peak = speed;
+    float scale = 1;
+    uint32_t accel_steps = 0;
+    uint32_t decel_steps = 0;
+
+    if (steps == 0)
+    {
+        return 0;
+    }
+
+    if (start > peak)
+    {
+        start = peak;
+    }
+
+    // The S-Curve ramps are 1.5x longer for the same peak rate
+    if (profile->mode == PROFILE_SCURVE)
+    {
+        scale = 1.5f;
+    }
+
+    accel_steps = (uint32_t) (scale * (peak - start) / accel);
+    decel_steps = (uint32_t) (scale * (peak - start) / decel);
+
+    if (accel_steps + decel_steps > steps)
+    {
+        peak = start + steps / (scale / accel + scale / decel);
+        accel_steps = (uint32_t) (scale * (peak - start) / accel);
+        decel_steps = steps - accel_steps;
+    }
+
+    return (uint32_t) (RampTimeUS(profile->mode, start, peak, accel_steps)
+                     + ((steps - accel_steps - decel_steps) * STEPPERIODUS) / peak
+                     + RampTimeUS(profile->mode, peak, start, decel_steps));
+}
+
+/* =======================================================
+ * Function Name: ParkMoveUS
+ * =======================================================
+ * Parameters: profile, phase
+ * Return: time (microseconds)
+ * Description: Helper function to predict the time of
+ * the move that parks the auger drive from the given
+ * phase (See ParkAuger).
+ * =======================================================
+ */
+static uint32_t ParkMoveUS(const MotorProfileStructType* profile, int32_t phase)
+{
+    return EstimateMoveUS(profile, AUGPARKSPD, (phase > AUGERUSTEPREV / 2) ? AUGERUSTEPREV - phase : phase);
+}
+
+/* =======================================================
+ * Function Name: EstimateItemUS
+ * =======================================================
+ * Parameters: position, microsteps, rack, phase
+ * Return: time (microseconds)
+ * Description: Helper function to predict the time of one
+ * dispense from the start of the rack move to the end of
+ * the dose, see DispenseTask. Rack and phase are the rack
+ * position and auger phase (microsteps) before the
+ * dispense and are updated to the values after it. The
+ * auger is parked during the rack move and settle, so only
+ * the longer of the two counts.
+ * =======================================================
+ */
+static uint32_t EstimateItemUS(uint8_t position, uint32_t microsteps, int32_t* rack, int32_t* phase)
+{
+    MotorProfileStructType profile = AugerSlotProfile(position);
+    int32_t delta = RackDeltaFrom(*rack, SLOT_USTEPS[position]);
+    uint32_t rack_time = 0;
+    uint32_t park_time = 0;
+
+    *rack = SLOT_USTEPS[position];
+
+    rack_time = EstimateMoveUS(&RACK_SCURVE_PROF, RACK_SPEED, (delta < 0) ? -delta : delta);
+    rack_time += RACK_SCURVE_PROF.settle;
+    park_time = ParkMoveUS(&profile, *phase);
+    *phase = ((int32_t) microsteps + AUG_OFFSET) % AUGERUSTEPREV;
+
+    return ((rack_time > park_time) ? rack_time : park_time)
+         + ServoMoveUS(SVO_DIS_POS, SVO_ENG_POS)
+         + EstimateMoveUS(&profile, AUGER_SPEED[position], microsteps + AUG_OFFSET);
+}
+
+/* =======================================================
+ * Function Name: EstimateDispenseUS
+ * =======================================================
+ * Parameters: position, quantity, rack_angle
+ * Return: time (microseconds)
+ * Description: This function predicts how long a single
+ * (serial) dispense of a quantity of half-teaspoons from a
+ * slot takes, starting with the rack at rack_angle (See
+ * rack_pos). This includes the rack move and settle, the
+ * servo engage and release and the auger dose, using the
+ * current motion profiles and calibration.
+ * =======================================================
+ */
+uint32_t EstimateDispenseUS(uint8_t position, uint16_t quantity, uint16_t rack_angle)
+{
+    MotorProfileStructType profile = AugerSlotProfile(position);
+    int32_t rack = ((int32_t) rack_angle * RACKUSTEPREV) / 360;
+    int32_t phase = AugerPhase();
+    uint32_t time = EstimateItemUS(position, DoseSteps(position, quantity), &rack, &phase);
+
+    // The auger is parked once the clutch is released (See DispenseFlush)
+    return time + ServoMoveUS(SVO_ENG_POS, SVO_DIS_POS) + ParkMoveUS(&profile, phase);
+}
+
+/* =======================================================
+ * Function Name: EstimateRecipeUS
+ * =======================================================
+ * Parameters: items, count, rack_angle
+ * Return: time (microseconds)
+ * Description: This function predicts how long the
+ * pipelined dispense of a list of doses (slot and
+ * quantity) takes, starting with the rack at rack_angle
+ * (See rack_pos). In the pipelined mode each rack move
+ * begins once the clutch is clear of the previous spice
+ * holder, and only the last clutch release is waited for
+ * in full. Consecutive doses from the same slot are
+ * dispensed without releasing the clutch. See
+ * EstimateDispenseUS.
+ * =======================================================
+ */
+uint32_t EstimateRecipeUS(const SpiceDataType* items, uint8_t count, uint16_t rack_angle)
+{
+    int32_t rack = ((int32_t) rack_angle * RACKUSTEPREV) / 360;
+    int32_t phase = AugerPhase();
+    uint32_t time = 0;
+    uint32_t microsteps = 0;
+    uint8_t position = 0;
+    uint8_t i = 0;
+    MotorProfileStructType profile;
+
+    for (i = 0; i < count; i++)
+    {
+        if (items[i].DataBits.quantity == 0)
+        {
+            break;
+        }
+
+        position = items[i].DataBits.position;
+        microsteps = DoseSteps(position, items[i].DataBits.quantity);
+
+        // The clutch is held between doses from the same slot, so
+        // only the auger turns (See StartDispenseNext)
+        if (i != 0 && position == items[i - 1].DataBits.position)
+        {
+            profile = AugerSlotProfile(position);
+            time += EstimateMoveUS(&profile, AUGER_SPEED[position], microsteps);
+            phase = (phase + (int32_t) microsteps) % AUGERUSTEPREV;
+            continue;
+        }
+
+        if (i != 0)
+        {
+            time += SVO_CLEAR_TIME;
+        }
+
+        time += EstimateItemUS(position, microsteps, &rack, &phase);
+    }
+
+    // The auger is parked once the last clutch release is done
+    if (i != 0)
+    {
+        profile = AugerSlotProfile(position);
+        time += ServoMoveUS(SVO_ENG_POS, SVO_DIS_POS) + ParkMoveUS(&profile, phase);
+    }
+
+    return time;
+}
+
+/* =======================================================
+ * Function Name: RackMoveUS
+ * =======================================================
+ * Parameters: from, to
+ * Return: time (microseconds)
+ * Description: Helper function to predict the time of the
+ * shortest slot move between two rack positions, including
+ * the settle time. No time is needed if the rack is
+ * already in place.
+ * =======================================================
+ */
+static uint32_t RackMoveUS(int32_t from, int32_t to)
+{
+    int32_t delta = RackDeltaFrom(from, to);
+
+    if (delta == 0)
+    {
+        return 0;
+    }
+
+    return EstimateMoveUS(&RACK_SCURVE_PROF, RACK_SPEED, (delta < 0) ? -delta : delta) + RACK_SCURVE_PROF.settle;
+}
+
+/* =======================================================
+ * Function Name: PlanDoseOrder
+ * =======================================================
+ * Parameters: items, count, rack
+ * Return: None
+ * Description: This function reorders a list of doses
+ * (slot and quantity) so the rack visits their slots in
+ * the shortest time, starting from the given rack position
+ * (microsteps). The list ends at count or at the first
+ * zero quantity. Doses from the same slot are kept
+ * together and in their original order.
+ * The slots are sorted CW from the rack, so the slots
+ * visited at any point form an arc around the start with
+ * the rack at one of its two ends. The arc is grown one
+ * slot at a time on either end (O(n^2) states) using the
+ * rack move time model, which finds the fastest tour that
+ * never passes over a slot it has yet to stop at.
+ * =======================================================
+ */
+void PlanDoseOrder(SpiceDataType* items, uint8_t count, int32_t rack)
+{
+    // Kept off the stack (Time to reach each arc and the end it was reached from)
+    static uint32_t cost[MAXSLOTS + 1][MAXSLOTS + 1][2];
+    static uint8_t from[MAXSLOTS + 1][MAXSLOTS + 1][2];
+    static uint32_t move[MAXSLOTS + 1][MAXSLOTS + 1];
+    uint8_t slot[MAXSLOTS];
+    uint32_t offset[MAXSLOTS];
+    uint8_t tour[MAXSLOTS];
+    uint8_t visit[MAXSLOTS];
+    uint8_t n = 0;
+    uint8_t m = 0;
+    uint8_t i = 0;
+    uint8_t j = 0;
+    uint8_t k = 0;
+    uint8_t e = 0;
+    uint8_t here = 0;
+    uint8_t best_i = 0;
+    uint8_t best_e = 0;
+    uint32_t time = 0;
+    uint32_t best = 0xFFFFFFFF;
+    SpiceDataType item;
+
+    // Collect the distinct slots with their CW offset from the rack
+    for (m = 0; m < count && items[m].DataBits.quantity != 0; m++)
+    {
+        for (i = 0; i < n && slot[i] != items[m].DataBits.position; i++);
+
+        if (i == n && n < MAXSLOTS)
+        {
+            slot[n] = items[m].DataBits.position;
+            offset[n] = (uint32_t) (RackDeltaFrom(rack, SLOT_USTEPS[slot[n]]) + RACKUSTEPREV) % RACKUSTEPREV;
+            n++;
+        }
+    }
+
+    if (n < 2)
+    {
+        return;
+    }
+
+    // Sort the slots CW from the rack
+    for (i = 1; i < n; i++)
+    {
+        for (j = i; j > 0 && offset[j - 1] > offset[j]; j--)
+        {
+            k = slot[j];
+            slot[j] = slot[j - 1];
+            slot[j - 1] = k;
+            time = offset[j];
+            offset[j] = offset[j - 1];
+            offset[j - 1] = time;
+        }
+    }
+
+    // Move time between each pair of slots. Index n is the start
+    for (i = 0; i <= n; i++)
+    {
+        for (j = i; j <= n; j++)
+        {
+            move[i][j] = RackMoveUS((i == n) ? rack : SLOT_USTEPS[slot[i]], (j == n) ? rack : SLOT_USTEPS[slot[j]]);
+            move[j][i] = move[i][j];
+        }
+    }
+
+    // cost[i][j][e] is the time to visit the first i slots CW and the
+    // last j slots CCW, ending CW (e = 0) or CCW (e = 1)
+    for (i = 0; i <= n; i++)
+    {
+        for (j = 0; j <= n; j++)
+        {
+            cost[i][j][0] = 0xFFFFFFFF;
+            cost[i][j][1] = 0xFFFFFFFF;
+        }
+    }
+
+    cost[0][0][0] = 0;
+    cost[0][0][1] = 0;
+
+    for (k = 0; k < n; k++)
+    {
+        for (i = 0; i <= k; i++)
+        {
+            j = k - i;
+
+            for (e = 0; e < 2; e++)
+            {
+                if (cost[i][j][e] == 0xFFFFFFFF)
+                {
+                    continue;
+                }
+
+                if (e == 0)
+                {
+                    here = (i == 0) ? n : i - 1;
+                }
+                else
+                {
+                    here = (j == 0) ? n : n - j;
+                }
+
+                // Extend the arc CW
+                time = cost[i][j][e] + move[here][i];
+                if (time < cost[i + 1][j][0])
+                {
+                    cost[i + 1][j][0] = time;
+                    from[i + 1][j][0] = e;
+                }
+
+                // Extend the arc CCW
+                time = cost[i][j][e] + move[here][n - 1 - j];
+                if (time < cost[i][j + 1][1])
+                {
+                    cost[i][j + 1][1] = time;
+                    from[i][j + 1][1] = e;
+                }
+            }
+        }
+    }
+
+    for (i = 0; i <= n; i++)
+    {
+        for (e = 0; e < 2; e++)
+        {
+            if (cost[i][n - i][e] < best)
+            {
+                best = cost[i][n - i][e];
+                best_i = i;
+                best_e = e;
+            }
+        }
+    }
+
+    // Walk the tour back from its last slot
+    i = best_i;
+    j = n - best_i;
+    e = best_e;
+
+    for (k = n; k > 0; k--)
+    {
+        here = from[i][j][e];
+
+        if (e == 0)
+        {
+            tour[k - 1] = slot[i - 1];
+            i--;
+        }
+        else
+        {
+            tour[k - 1] = slot[n - j];
+            j--;
+        }
+
+        e = here;
+    }
+
+    // Stable sort the doses by when their slot is visited
+    for (i = 0; i < n; i++)
+    {
+        visit[tour[i]] = i;
+    }
+
+    for (i = 1; i < m; i++)
+    {
+        item = items[i];
+
+        for (j = i; j > 0 && visit[items[j - 1].DataBits.position] > visit[item.DataBits.position]; j--)
+        {
+            items[j] = items[j - 1];
+        }
+
+        items[j] = item;
+    }
+}
 
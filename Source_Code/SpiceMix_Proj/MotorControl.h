@@ -11,12 +11,48 @@
 #include <stdbool.h>
 #include <stdint.h>
 #include "System.h"
+#include "StepMotor.h"
+#include "eepromControl.h"
 
 /*========================================================
  * Preprocessor Defintions
  *========================================================
  */
 #define ERRORHOMEFAIL 0xDEAF
+#define DISPNEXTNONE 0xFF           // No dispense follows (See StartDispenseNext)
+
+// Rack Geometry (Microsteps)
+// The number of slots and the angle of each slot are set at run
+// time (See SetRackSlots and SetSlotAngle), up to MAXSLOTS.
+#define SLOTANGLETENTHS 3600            // Slot angles are entered in tenths of a degree
+
+// Auger Geometry (Microsteps)
+#define AUGERUSTEPREV USTEPFULL360      // The auger is driven directly by its motor
+#define AUGERMAXSPD 150                 // Max auger speed (RPM)
+#define AUGERMAXRAMP 250                // Max auger ramp rate (RPM per rotation)
+#define AUGPARKSPD 35                   // Auger park speed (RPM), see ParkAuger
+
+// Step period (microseconds) of a motor running at 1 RPM
+#define STEPPERIODUS (60e6f / USTEPFULL360)
+#define RAMPESTSAMPLES 256      // Max number of speed samples of a ramp estimate
+
+// Homing (Microsteps, RPM and Microseconds)
+#define HOMESEEKDIST (RACKUSTEPREV + RACKUSTEPREV / 4)  // Longest fast seek before failing
+#define HOMEMARGIN (RACKUSTEPREV / 16)                  // Distance the precise approach starts before the edge
+#define HOMESEEKSPD 30
+#define HOMEAPPROACHSPD 6
+#define HOMEREVERSEUS 100000                            // Pause before reversing the rack
+
+// Rack Auto-Tune (See RackTuneTrial)
+#define RACKTUNEREFSPD 10                   // Speed the hall edges are learnt at
+#define RACKTUNEDEFSPD 30                   // Default slot move speed, never tuned below
+#define RACKTUNESTARTSPD 30
+#define RACKTUNESPDSTEP 5
+#define RACKTUNEMAXSPD 120
+#define RACKTUNEACCELSTEP (RACKACCELQ16 / 4)
+#define RACKTUNEMAXACCEL (RACKACCELQ16 * 4)
+#define RACKTUNEMAXERR (USTEPRES)           // Hall edge error (microsteps) treated as lost steps
+#define RACKTUNEMARGIN 80                   // Percent of the limit used after tuning
 
 /*========================================================
  * Variable Definitions
@@ -28,6 +64,15 @@ extern int16_t HOME_OFFSET;
 extern int16_t AUG_OFFSET;
 extern uint16_t SVO_ENG_POS;
 extern uint16_t SVO_DIS_POS;
+extern uint32_t SVO_CLEAR_TIME;
+extern uint16_t DOSE_USTEPS[MAXSLOTS];
+extern uint8_t AUGER_SPEED[MAXSLOTS];
+extern uint8_t AUGER_RAMP[MAXSLOTS];
+extern uint8_t RACK_SLOTS;
+extern uint16_t SLOT_USTEPS[MAXSLOTS];
+extern uint16_t RACK_SPEED;
+extern MotorProfileStructType RACK_TRAP_PROF;
+extern MotorProfileStructType RACK_SCURVE_PROF;
 
 extern uint16_t rack_pos;
 
@@ -37,15 +82,72 @@ typedef enum
 	AUGER
 }MotorTypeEnum;
 
+typedef enum
+{
+	DISP_IDLE,
+	DISP_CLEAR,
+	DISP_RACK,
+	DISP_SETTLE,
+	DISP_ENGAGE,
+	DISP_AUGER,
+	DISP_RELEASE
+}DispenseStateEnumType;
+
+typedef struct
+{
+	DispenseStateEnumType state;
+	uint8_t position;
+	uint32_t steps;
+	uint32_t deadline;
+	MotionHandleType move;
+	MotionHandleType auger;
+	bool pipelined;
+	bool auger_on;
+	bool releasing;
+	bool hold;
+	bool engaged;
+	bool startup;
+	uint32_t clear;
+	uint32_t released;
+}DispenseStructType;
+
 /*========================================================
  * Function Declarations
  *========================================================
  */
 
+extern bool RestoreRackState(void);
+extern uint16_t FlushRackState(void);
+extern bool IsRackPositionValid(void);
 extern uint16_t StepRackHome(void);
-extern void SetRackPos(uint16_t angle);
-extern void SetAugerPos(uint16_t rotations);
+extern int32_t RackDelta(int32_t target);
+extern int32_t RackDeltaFrom(int32_t rack, int32_t target);
+extern void SetRackSlots(uint8_t slots);
+extern void SetSlotAngle(uint8_t position, uint16_t microsteps);
+extern uint32_t SlotDistance(int32_t rack, uint8_t position);
+extern MotionHandleType StartRackPos(uint16_t pos);
+extern void SetRackTune(uint16_t speed, uint32_t accel);
+extern void RackTuneReference(void);
+extern uint32_t RackTuneTrial(uint16_t speed, uint32_t accel);
+extern void SetRackPos(uint16_t pos);
+extern int32_t AugerPhase(void);
+extern MotionHandleType ParkAuger(void);
+extern uint32_t DoseSteps(uint8_t position, uint16_t quantity);
+extern void SetAugerProfile(uint8_t position);
+extern MotionHandleType StartAugerPos(uint32_t microsteps, uint16_t speed);
+extern void SetAugerPos(uint32_t microsteps, uint16_t speed);
+extern bool StartDispense(uint8_t position, uint16_t quantity);
+extern bool StartDispenseSteps(uint8_t position, uint32_t microsteps);
+extern bool StartDispenseNext(uint8_t position, uint16_t quantity, uint8_t next);
+extern void InitDispense(void);
+extern bool DispenseTask(void);
+extern void SetDispensePipeline(bool enable);
+extern void DispenseFlush(void);
 extern void DispenseSequence(uint8_t position, uint16_t quantity);
+extern uint32_t EstimateMoveUS(const MotorProfileStructType* profile, uint16_t speed, uint32_t steps);
+extern uint32_t EstimateDispenseUS(uint8_t position, uint16_t quantity, uint16_t rack_angle);
+extern uint32_t EstimateRecipeUS(const SpiceDataType* items, uint8_t count, uint16_t rack_angle);
+extern void PlanDoseOrder(SpiceDataType* items, uint8_t count, int32_t rack);
 extern void TestMotors(void);
 
 #endif /* STEPPER_H_ */
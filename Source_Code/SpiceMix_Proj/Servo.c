@@ -10,7 +10,18 @@
  */
 
 #include "Servo.h"
-#include "wait.h"
+
+/*========================================================
+ * Variable Definitions
+ *========================================================
+ */
+
+// Servo slew rate (us per degree). Loaded from the EEPROM on
+// start-up (See initServoSlew)
+uint16_t SERVO_SLEW_US = SERVOSLEWUS;
+
+// Last commanded angle
+static uint16_t servo_angle = SERVOANGLENONE;
 
 /* =======================================================
  * Function Name: ServoInit
@@ -57,21 +68,58 @@ void ServoInit(void)
     WTIMER3_TBV_R = 0;                  // Set Initial Value to 0
     WTIMER3_CTL_R |= TIMER_CTL_TBEN | TIMER_CTL_TBPWML; // Enable the timer and invert PWM output
 
-    SetServoPos(180);
+    // The clutch is released by InitDispense, which only waits
+    // until it is clear
 }
 
 /* =======================================================
- * Function Name: SetServoPos
+ * Function Name: ServoMoveUS
+ * =======================================================
+ * Parameters: from, to
+ * Return: time (microseconds)
+ * Description: This function returns the time allowed for
+ * the servo to move between two angles, from the angle
+ * moved and the slew rate. No time is needed if the angle
+ * does not change. A move from SERVOANGLENONE is allowed
+ * the time of the full range.
+ * =======================================================
+ */
+uint32_t ServoMoveUS(uint16_t from, uint16_t to)
+{
+    uint32_t delta = 180;
+
+    if (from != SERVOANGLENONE)
+    {
+        delta = (from > to) ? from - to : to - from;
+    }
+
+    if (delta == 0)
+    {
+        return 0;
+    }
+
+    return delta * SERVO_SLEW_US + SERVOSETTLEUS;
+}
+
+/* =======================================================
+ * Function Name: StartServoPos
  * =======================================================
  * Parameters: angle
- * Return: None
+ * Return: deadline
  * Description: This sets the servo to the requested
- * angle by adjusting the Wide-Timer 3 Match Register
+ * angle by adjusting the Wide-Timer 3 Match Register.
+ * The function does not wait for the servo to move,
+ * instead the time base deadline at which the servo is
+ * expected to have reached the angle is returned. The
+ * deadline is taken from the move from the last commanded
+ * angle (See ServoMoveUS), so it has already passed if
+ * the angle is unchanged.
  * =======================================================
  */
-void SetServoPos(uint16_t angle)
+uint32_t StartServoPos(uint16_t angle)
 {
     uint32_t duty = 0;
+    uint32_t time = 0;
 
     //Limit Servo Angle between 0 and 180
     if (angle > 180)
@@ -86,5 +134,22 @@ void SetServoPos(uint16_t angle)
     WTIMER3_TAMATCHR_R = duty;
     WTIMER3_TBMATCHR_R = duty;
 
-    waitMicrosecond(800000);
+    time = ServoMoveUS(servo_angle, angle);
+    servo_angle = angle;
+
+    return GetTimeBase() + UStoTICKS(time);
+}
+
+/* =======================================================
+ * Function Name: SetServoPos
+ * =======================================================
+ * Parameters: angle
+ * Return: None
+ * Description: This sets the servo to the requested
+ * angle and waits for the servo to reach the position.
+ * =======================================================
+ */
+void SetServoPos(uint16_t angle)
+{
+    WaitUntil(StartServoPos(angle));
 }
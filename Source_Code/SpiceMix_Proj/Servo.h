@@ -22,14 +22,32 @@
 #define SERVOBIAS (SYSCLOCK/50)*0.025	
 #define SERVOSF (SYSCLOCK/50)*0.1		// Scale Factor for Servo Angle Calculation
 
+// Servo Move Time Model
+// The time allowed for a move is the angle moved times the slew
+// rate plus a settle time. The defaults allow 800ms for the 70
+// degree clutch move. The slew rate can be calibrated (See SERVO_SLEW_US)
+#define SERVOSLEWUS 11000	// Default time (us) per degree moved
+#define SERVOSETTLEUS 30000	// Time (us) to settle after a move
+#define SERVOMINSLEW 1000	// Limits of the slew rate (us per degree)
+#define SERVOMAXSLEW 20000
+#define SERVOANGLENONE 0xFFFF	// Servo angle before the first move
+
 #define MINSVOPOS 145
 #define MAXSVOPOS 45
 
+/*========================================================
+ * Variable Definitions
+ *========================================================
+ */
+extern uint16_t SERVO_SLEW_US;
+
 /*========================================================
  * Function Declarations
  *========================================================
  */
 extern void ServoInit(void);
+extern uint32_t ServoMoveUS(uint16_t from, uint16_t to);
+extern uint32_t StartServoPos(uint16_t angle);
 extern void SetServoPos(uint16_t angle);
 
 #endif /* SERVO_H_ */
@@ -7,6 +7,7 @@
  * =======================================================
  */
 
+#include <string.h>
 #include "StepMotor.h"
 #include "tm4c123gh6pm.h"
 #include "wait.h"
@@ -17,10 +18,49 @@
  */
 
 // For Debugging Remove the Static
-MotorDataStructType MotorData[2] =
+MotorDataStructType MotorData[NUMMOTORS] =
 {
-    {OFF, CW, NOTHOME, 0, 0, 3},
-    {OFF, CW, NOTHOME, 0, 0, 3}
+    {.runstatus = OFF, .direction = CW, .homestatus = NOTHOME, .speed = 3,
+     .profile = {PROFILE_TRAP, RACKSTARTQ16, RACKACCELQ16, RACKDECELQ16, RACKSETTLEUS}},
+    {.runstatus = OFF, .direction = CW, .homestatus = NOTHOME, .speed = 3,
+     .profile = {PROFILE_TRAP, AUGERSTARTQ16, AUGERACCELQ16, AUGERDECELQ16, AUGERSETTLEUS}}
+};
+
+// Hardware of each motor, indexed by motorID. Adding a motor
+// only needs an entry here, its pin set-up in StepMotorInit
+// and an interrupt vector calling MotorStepISR.
+static const MotorHwStructType MotorHw[NUMMOTORS] =
+{
+    // Rack Motor: M0PWM0 Step (PB6), Dir (PB7), Enable (PB5)
+    {MOTORREG(PWM0_0_LOAD_R), MOTORREG(PWM0_0_CMPA_R), MOTORREG(PWM0_0_CTL_R), MOTORREG(PWM0_0_GENA_R),
+     MOTORREG(PWM0_0_INTEN_R), MOTORREG(PWM0_0_ISC_R), MOTORREG(PWM0_INTEN_R), MOTORREG(PWM0_ENABLE_R),
+     MOTORREG(PWM0_CTL_R), 0x01, 0x01, 0x03, INT_PWM0_0, BITBAND(0x40005000, 7), BITBAND(0x40005000, 5),
+     MOTORREG(PWM0_0_COUNT_R)},
+    // Auger Motor: M1PWM4 Step (PF0), Dir (PF1), Enable (PF2)
+    {MOTORREG(PWM1_2_LOAD_R), MOTORREG(PWM1_2_CMPA_R), MOTORREG(PWM1_2_CTL_R), MOTORREG(PWM1_2_GENA_R),
+     MOTORREG(PWM1_2_INTEN_R), MOTORREG(PWM1_2_ISC_R), MOTORREG(PWM1_INTEN_R), MOTORREG(PWM1_ENABLE_R),
+     MOTORREG(PWM1_CTL_R), 0x04, 0x10, 0x0C, INT_PWM1_2, BITBAND(0x40025000, 1), BITBAND(0x40025000, 2),
+     MOTORREG(PWM1_2_COUNT_R)}
+};
+
+// Hall Sensor Edge References (Rack Motor). See PortBISR()
+HallRefStructType HallRef = { 0, };
+
+#if MOTIONSTATS
+// Step Interrupt Timing of each motor. See MotionStatsEntry()
+static MotionStatsStructType MotionStats[NUMMOTORS] = { 0, };
+static MotionProbeStructType MotionProbe[NUMMOTORS] = { 0, };
+#endif
+
+// Smoothstep (3x^2 - 2x^3) sampled at 32 even intervals in Q16.
+// Used by the S-Curve ramp. See SCurveShape()
+static const uint32_t SCurveTable[SCURVETBLSIZE + 1] =
+{
+        0,   188,   736,  1620,  2816,  4300,  6048,  8036,
+    10240, 12636, 15200, 17908, 20736, 23660, 26656, 29700,
+    32768, 35836, 38880, 41876, 44800, 47628, 50336, 52900,
+    55296, 57500, 59488, 61236, 62720, 63916, 64800, 65348,
+    65536
 };
 
 /*========================================================
@@ -36,12 +76,16 @@ MotorDataStructType MotorData[2] =
   * Description: Initializes the peripherals needed for
   * Stepper Motor Control. The system utilizes two stepper
   * motors. This will initialize Port B5-7 and PortF0-3
-  * for the motor output. Additionally PWM module 0 (PB4-7)
-  * are initialized for PWM control
+  * for the motor output. Additionally the PWM generator
+  * of each motor in the motor table (MotorHw) is
+  * initialized for PWM control
   * =======================================================
   */
 void StepMotorInit(void)
 {
+    const MotorHwStructType* hw;
+    uint32_t motorID = 0;
+
     // Enable GPIO PORTB, and PORTF
     SYSCTL_RCGCGPIO_R |= SYSCTL_RCGCGPIO_R1 | SYSCTL_RCGCGPIO_R5;
     SYSCTL_RCGCPWM_R |= SYSCTL_RCGCPWM_R0 | SYSCTL_RCGCPWM_R1;  // PWM0 Module for Motor Control
@@ -63,50 +107,98 @@ void StepMotorInit(void)
     GPIO_PORTF_PCTL_R &= ~0x0005;       // Clear bits for enabling
     GPIO_PORTF_PCTL_R |= 0x0005;        // Enable M1PWM2 (PF0)
 
-    // Initialize PWM Module 0
-    SYSCTL_SRPWM_R = SYSCTL_SRPWM_R0| SYSCTL_SRPWM_R1;   // Reset PWM1 module
+    // Reset the PWM modules
+    SYSCTL_SRPWM_R = SYSCTL_SRPWM_R0| SYSCTL_SRPWM_R1;
     SYSCTL_SRPWM_R = 0;     // Turn off Reset
-    PWM0_0_CTL_R = 0;       // Turn-off PWM1 Gen1 (Drives PWM2/3)
-    PWM1_2_CTL_R = 0;       // Turn-off PWM1 Gen1 (Drives PWM2/3)
 
-    // Enable Global Sync for PWM Generators
-    PWM0_0_CTL_R |= 0x3F8;
-    PWM1_2_CTL_R |= 0x3F8;
+    for (motorID = 0; motorID < NUMMOTORS; motorID++)
+    {
+        hw = &MotorHw[motorID];
+
+        // Turn-off the generator and enable Global Sync
+        *hw->genctl = 0;
+        *hw->genctl |= 0x3F8;
 
-    // Set for PWM high when counter = comparator. Low when counter = 0
-    // Generator B configured to look at comparator A
-    PWM0_0_GENA_R = PWM_0_GENA_ACTCMPAD_ONE | PWM_0_GENA_ACTZERO_ZERO;
-    PWM1_2_GENA_R = PWM_1_GENA_ACTCMPAD_ONE | PWM_1_GENA_ACTZERO_ZERO;
+        // Set for PWM high when counter = comparator. Low when counter = 0
+        *hw->gena = PWM_0_GENA_ACTCMPAD_ONE | PWM_0_GENA_ACTZERO_ZERO;
 
-    // Set PWM Frequency
-    PWM0_0_LOAD_R = 0xFFFF; //Max load = lowest RPM
-    PWM1_2_LOAD_R = 0xFFFF; //Max load = lowest RPM
+        // Set PWM Frequency. Max load = lowest RPM
+        *hw->load = 0xFFFF;
 
-    // PWM Off on Power-up (Duty cycle = 0)
-    PWM0_0_CMPA_R = 0x0FF;
-    PWM1_2_CMPA_R = 0x0FF;
+        // PWM Off on Power-up (Duty cycle = 0)
+        *hw->cmpa = 0x0FF;
 
-    PWM0_INTEN_R |= 0x01;
-    PWM1_INTEN_R |= 0x04;
+        // Register the generator interrupt
+        *hw->modinten |= hw->genbit;
+        (&NVIC_EN0_R)[(hw->irq - 16) >> 5] |= 1 << ((hw->irq - 16) & 0x1F);
 
-    NVIC_EN0_R |= 1 << (INT_PWM0_0 - 16);   // Register the PWM0 Interrupt
-    NVIC_EN4_R |= 1 << (INT_PWM1_2 - 16-128);   // Register the PWM0 Interrupt
-    
-    // Enable PWM Generators
-    PWM0_0_CTL_R |= 0x01;
-    PWM0_1_CTL_R |= 0x01;
-    PWM0_ENABLE_R = 0x00;;
+        // Enable the generator with the output off and sync
+        *hw->genctl |= 0x01;
+        *hw->enable &= ~hw->outbit;
+        *hw->ctl = hw->sync;
+
+        // Turn Off Motors on Start-up
+        *hw->en = 1;
+    }
+}
+
+/* =======================================================
+ * Function Name: MotorIntDisable
+ * =======================================================
+ * Parameters: motorID
+ * Return: None
+ * Description:
+ * Helper function to hold off the step interrupt of a
+ * motor while its motor data is being changed.
+ * =======================================================
+ */
+static inline void MotorIntDisable(uint32_t motorID)
+{
+    *MotorHw[motorID].inten &= ~0x02;
+}
+
+/* =======================================================
+ * Function Name: MotorIntEnable
+ * =======================================================
+ * Parameters: motorID
+ * Return: None
+ * Description:
+ * Helper function to enable the step interrupt of a motor
+ * (PWM load interrupt) so it will start or continue to
+ * run the motor.
+ * =======================================================
+ */
+static inline void MotorIntEnable(uint32_t motorID)
+{
+    *MotorHw[motorID].inten |= 0x02;
+}
 
-    PWM1_2_CTL_R |= 0x01;
-    PWM1_ENABLE_R = 0x00;
+/* =======================================================
+ * Function Name: RampFrom
+ * =======================================================
+ * Parameters: motor, speed (Q16)
+ * Return: None
+ * Description:
+ * Helper function to begin a new acceleration ramp of a
+ * motor at the given speed towards its commanded speed.
+ * For an S-Curve profile the length of the acceleration is
+ * calculated here so the peak acceleration matches the
+ * profile accel rate.
+ * =======================================================
+ */
+static inline void RampFrom(MotorDataStructType* motor, uint32_t speed)
+{
+    MotorRampStructType* ramp = &motor->ramp;
+    uint32_t max_speed = motor->speed << 16;
 
-    // Sync 
-    PWM0_CTL_R = 0xF;
-    PWM1_CTL_R = 0xF;
+    ramp->phase = RAMP_ACCEL;
+    ramp->speed = speed;
+    ramp->base = speed;
+    ramp->span = (max_speed > speed) ? max_speed - speed : 0;
+    ramp->count = 0;
 
-    // Turn Off Motors on Start-up
-    MOTOR0EN = 1;
-    MOTOR1EN = 1;
+    // The smoothstep peak slope is 1.5x the average slope
+    ramp->length = ((ramp->span / motor->profile.accel) * 3) / 2;
 }
 
 /* =======================================================
@@ -149,39 +241,153 @@ void HallSensorInit(void)
  * The function will set the direction pins and enable 
  * the requested motor. The function will also enable the
  * corresponding PWM interrupt to begin the motor command.
+ * Any segments still waiting in the motor queue are
+ * discarded, the command replaces the current motion and
+ * the handles of the replaced moves report as done.
+ * A handle is returned which can be used to poll or wait
+ * for the completion of the move.
  * =======================================================
  */
-void CommandMotor(uint32_t motorID, int32_t microsteps, uint16_t speed)
+MotionHandleType CommandMotor(uint32_t motorID, int32_t microsteps, uint16_t speed)
 {
+    MotorDataStructType* motor = &MotorData[motorID];
+    MotionHandleType handle = {motorID, MOTIONINVALID};
     uint32_t dir = CW;
     int32_t sign = 1;
 
-    SetMotorSpd(motorID, speed);
-
     if (microsteps < 0)
     {
         dir = CCW;
         sign = -1;
     }
-    
-    MotorData[motorID].steps = (uint32_t) microsteps*sign;
 
-    switch (motorID)
+    // Hold off the step interrupt while the command is replaced
+    MotorIntDisable(motorID);
+
+    SetMotorSpd(motorID, speed);
+
+    // Retire the replaced and discarded moves
+    motor->queue.tail = motor->queue.head;
+    motor->completed = motor->issued;
+
+    motor->issued++;
+    handle.ticket = motor->issued;
+    motor->active = true;
+    motor->callback = 0;
+    motor->dwell = 0;
+    motor->ramp.exit = 0;
+    // A running move that is replaced continues from its current
+    // speed, so a ramp that was part way through (e.g. decelerating)
+    // restarts from there instead of jumping. A reversal starts over.
+    if (motor->runstatus == RUNNING)
+    {
+        if (motor->direction == (MotorDirEnumType) dir)
+        {
+            RampFrom(motor, motor->ramp.speed);
+        }
+        else
+        {
+            RampFrom(motor, (motor->profile.start < (motor->speed << 16)) ? motor->profile.start : (motor->speed << 16));
+        }
+    }
+
+    motor->direction = (MotorDirEnumType) dir;
+    motor->steps = (uint32_t) microsteps*sign;
+
+    *MotorHw[motorID].dir = dir;
+
+    // Enable the Load Interrupt to start the move
+    MotorIntEnable(motorID);
+
+    return handle;
+}
+
+/* =======================================================
+ * Function Name: QueueMotorSegment
+ * =======================================================
+ * Parameters: motorID, microsteps, speed, dwell_us, callback
+ * Return: handle
+ * Description: This function appends a move to the
+ * segment queue of the specified motor. The PWM interrupt
+ * will start the segment as soon as the previous one has
+ * completed, without returning to the main program.
+ * The sign of microsteps is the direction. dwell_us is
+ * the time in microseconds to wait before the segment
+ * starts moving. If the following segment continues in the
+ * same direction with no dwell, the motor does not slow
+ * down to the start speed between them. The optional
+ * callback is called from the interrupt once the segment
+ * has completed. A handle is returned which can be used to
+ * poll or wait for the completion of the segment. If the
+ * queue is full the handle ticket is MOTIONINVALID.
+ * =======================================================
+ */
+MotionHandleType QueueMotorSegment(uint32_t motorID, int32_t microsteps, uint16_t speed, uint32_t dwell_us, MotionCallbackType callback)
+{
+    MotorDataStructType* motor = &MotorData[motorID];
+    MotorQueueStructType* queue = &motor->queue;
+    MotorSegmentStructType* segment = &queue->segment[queue->tail];
+    MotionHandleType handle = {motorID, MOTIONINVALID};
+    uint8_t next = (queue->tail + 1) % MOTORQUEUESIZE;
+
+    if (next == queue->head)
     {
-    case 0:
-        MOTOR0DIR = dir;
-        // Enable Load Interrupt for Gen 0
+        return handle;
+    }
 
-        PWM0_0_INTEN_R |= 0x02;
-        break;
-    case 1:
-        MOTOR1DIR = dir;
-        // Enable Load Interrupt for Gen 0
-        PWM1_2_INTEN_R |= 0x02;
-        break;
-    default:
-        break;
+    segment->direction = CW;
+    if (microsteps < 0)
+    {
+        segment->direction = CCW;
+        microsteps = -microsteps;
     }
+
+    segment->steps = (uint32_t) microsteps;
+    segment->speed = (speed < MINRPM) ? (uint16_t) MINRPM : speed;
+    segment->dwell = UStoPWMTICKS(dwell_us);
+    segment->callback = callback;
+
+    // Publish the segment to the interrupt
+    motor->issued++;
+    handle.ticket = motor->issued;
+    queue->tail = next;
+
+    // Make sure the interrupt is running to pick up the segment
+    MotorIntEnable(motorID);
+
+    return handle;
+}
+
+/* =======================================================
+ * Function Name: IsMotionDone
+ * =======================================================
+ * Parameters: handle
+ * Return: done
+ * Description:
+ * This function returns true once the move referred to by
+ * the handle has completed, or was replaced by a later
+ * CommandMotor/TurnOffMotor call. An invalid handle is
+ * always reported as done.
+ * =======================================================
+ */
+bool IsMotionDone(MotionHandleType handle)
+{
+    return (int32_t)(MotorData[handle.motorID].completed - handle.ticket) >= 0;
+}
+
+/* =======================================================
+ * Function Name: WaitMotion
+ * =======================================================
+ * Parameters: handle
+ * Return: None
+ * Description:
+ * This function blocks until the move referred to by
+ * the handle has completed.
+ * =======================================================
+ */
+void WaitMotion(MotionHandleType handle)
+{
+    while (!IsMotionDone(handle));
 }
 
 /* =======================================================
@@ -223,29 +429,84 @@ void SetMotorSpd(uint32_t motorID, uint16_t speed)
  */
 void TurnOffMotor(uint32_t motorID)
 {
-    switch (motorID)
-    {
-    case 0:
-        PWM0_ENABLE_R &= ~0x0F;
-        PWM0_0_INTEN_R &= ~0x02;
-        // Sync and Update Gen0 and Gen 1
-        PWM0_CTL_R = 0x03;
-        MOTOR0EN = 1;
-        break;
-    case 1:
-        PWM1_ENABLE_R &= ~0xF0;
-        PWM1_2_INTEN_R &= ~0x02;
-        // Sync and Update Gen0 and Gen 1
-        PWM1_CTL_R = 0x0C;
-        MOTOR1EN = 1;
-        break;
-    default:
-        break;
-    }
+    const MotorHwStructType* hw = &MotorHw[motorID];
+
+    *hw->enable &= ~hw->outbit;
+    MotorIntDisable(motorID);
+    // Sync and Update the Generator
+    *hw->ctl = hw->sync;
+    *hw->en = 1;
 
+    MotorData[motorID].queue.tail = MotorData[motorID].queue.head;
+    MotorData[motorID].completed = MotorData[motorID].issued;
+    MotorData[motorID].active = false;
+    MotorData[motorID].steps = 0;
+    MotorData[motorID].dwell = 0;
     MotorData[motorID].runstatus = OFF;
 }
 
+/* =======================================================
+ * Function Name: StopMotorMove
+ * =======================================================
+ * Parameters: motorID
+ * Return: None
+ * Description:
+ * This function brings the current move of the specified
+ * motor to a stop as soon as the motion profile allows.
+ * The remaining steps of the move are cut down to the
+ * distance needed to decelerate from the present speed,
+ * so the motor stops without losing steps. A move still
+ * in its dwell is ended without moving. The handle of the
+ * move reports as done once the motor has stopped.
+ * Segments queued after the move are not affected.
+ * =======================================================
+ */
+void StopMotorMove(uint32_t motorID)
+{
+    MotorDataStructType* motor = &MotorData[motorID];
+    uint32_t floor = motor->profile.start;
+    uint32_t decel_dist = 0;
+
+    if (!motor->active)
+    {
+        return;
+    }
+
+    MotorIntDisable(motorID);
+
+    if (motor->dwell != 0)
+    {
+        motor->steps = 0;
+        motor->dwell = 0;
+    }
+    else if (motor->ramp.phase != RAMP_DECEL)
+    {
+        if (floor > (motor->speed << 16))
+        {
+            floor = motor->speed << 16;
+        }
+
+        if (motor->ramp.speed > floor)
+        {
+            decel_dist = (motor->ramp.speed - floor) / motor->profile.decel;
+
+            if (motor->profile.mode == PROFILE_SCURVE)
+            {
+                decel_dist = (decel_dist * 3) / 2;
+            }
+        }
+
+        if (motor->steps > decel_dist)
+        {
+            motor->steps = decel_dist;
+        }
+    }
+
+    motor->ramp.exit = 0;
+
+    MotorIntEnable(motorID);
+}
+
 /* =======================================================
  * Function Name: GetMotorRunStatus
  * =======================================================
@@ -280,196 +541,897 @@ MotorHomeStatEnumType GetMotorHomeStatus(uint32_t motorID)
 }
 
 /* =======================================================
- * Function Name: PWM0Gen0_ISR
+ * Function Name: GetHallInput
  * =======================================================
- * Parameters: N/A
- * Return: N/A
+ * Parameters: None
+ * Return: input
  * Description:
- * This is the PWM Interrupt Handler for the Rack Motor.
- * This will interrupt when the PWM counter is zero. The
- * primary responsiblities of the interrupt handler is
- * to manage the steps the motor has moved as well as 
- * control the speed of the motor. All pertinent data
- * is provided from the corresponding MotorData structure.
- * The interrupt will read from this and then save the
- * updated value.
+ * This is a helper function to read the present state of
+ * the two hall sensor inputs (PB0/PB1). Unlike the home
+ * status, this does not rely on an edge having been seen
+ * since start-up.
  * =======================================================
  */
-void PWM0Gen0_ISR(void)
+uint32_t GetHallInput(void)
 {
-    static const uint32_t motorID = 0;
-    MotorRunStatEnumType status = OFF;
-    static uint32_t accel_steps = 0;
-    static uint32_t deccel_steps = 0;
-    static float deccel_factor = 0;
-    static float speed = MINRPM;
+    return HALLSEN & HALSEN_MASK;
+}
 
-    // Create a local copy for consistency
-    uint32_t steps = MotorData[motorID].steps;
-    float max_speed = MotorData[motorID].speed;
-    MotorRunStatEnumType status_pv = MotorData[motorID].runstatus;
-    uint32_t load = 0;
+/* =======================================================
+ * Function Name: GetMotorPosition
+ * =======================================================
+ * Parameters: motorID
+ * Return: position (microsteps)
+ * Description:
+ * This is a helper function to read the absolute position
+ * of a motor in microsteps. The position is counted by
+ * the PWM interrupt on every step, positive for CW.
+ * =======================================================
+ */
+int32_t GetMotorPosition(uint32_t motorID)
+{
+    return MotorData[motorID].position;
+}
 
-    if (status_pv != RUNNING)
-    {
-        accel_steps = steps / 2;
-        deccel_steps = steps / 2;
-        speed = MINRPM;
-        load = (uint32_t) (RPMtoLOAD/speed);
-        PWM0_0_LOAD_R = load;
-        PWM0_0_CMPA_R = load * 0.5;
-    }
+/* =======================================================
+ * Function Name: SetMotorPosition
+ * =======================================================
+ * Parameters: motorID, position
+ * Return: None
+ * Description:
+ * This function sets the absolute position (microsteps)
+ * of a motor, such as re-referencing the rack to 0 after
+ * homing. For the rack, the learnt hall sensor edge
+ * references are moved along with the position so they
+ * remain valid. It should only be used while the motor
+ * is not running.
+ * =======================================================
+ */
+void SetMotorPosition(uint32_t motorID, int32_t position)
+{
+    int32_t delta = position - MotorData[motorID].position;
+    uint32_t state = 0;
 
-    // Check if motor has moved the needed amount of steps.
-    if (steps > 0)
+    if (motorID == 0)
     {
-        if(accel_steps > 0 && steps > 600)
-        {
-            speed = speed + 0.03125;
-            if (speed > max_speed)
-            {
-                speed = max_speed;
-            }
-            accel_steps--;
-
-            deccel_factor = speed / deccel_steps;
-        }
-        else
+        for (state = 0; state < HALLNUMSTATES; state++)
         {
-            if (deccel_steps > 0)
-            {
-                speed = speed - deccel_factor;
-                if (speed < MINRPM)
-                {
-                    speed = MINRPM;
-                }
-            }
+            HallRef.reference[state][CW] += delta;
+            HallRef.reference[state][CCW] += delta;
         }
-
-        load = (uint32_t)(RPMtoLOAD / speed);
-        PWM0_0_LOAD_R = load;
-        PWM0_0_CMPA_R = load * 0.5;
-
-        PWM0_ENABLE_R |= 0x01;
-        MOTOR0EN = 0;
-        status = RUNNING;
-        steps--;
-    }
-    else
-    {
-        status = HALTED;
-        // Disable Load Interrupt
-        PWM0_ENABLE_R &= ~0x01;
-        PWM0_0_INTEN_R &= ~0x02;
+        HallRef.homeposition += delta;
     }
 
-    MotorData[motorID].runstatus = status;
-    MotorData[motorID].steps = steps;
-
-    // Sync and Update Gen0 and Gen 1
-    PWM0_CTL_R = 0x03;
-
-    // Clear Load Interrupt
-    PWM0_0_ISC_R |= 0x02;
+    MotorData[motorID].position = position;
 }
 
 /* =======================================================
- * Function Name: PWM1Gen2_ISR
+ * Function Name: ResetHallRef
  * =======================================================
- * Parameters: N/A
- * Return: N/A
+ * Parameters: None
+ * Return: None
  * Description:
- * This is the PWM Interrupt Handler for the Auger Motor.
- * This will interrupt when the PWM counter is zero. The
- * primary responsiblities of the interrupt handler is
- * to manage the steps the motor has moved as well as
- * control the speed of the motor. All pertinent data
- * is provided from the corresponding MotorData structure.
- * The interrupt will read from this and then save the
- * updated value.
+ * This function forgets all learnt hall sensor edge
+ * references. They are learnt again the next time the rack
+ * passes each edge. Used when the rack position is no
+ * longer trusted, i.e. at the start of homing.
  * =======================================================
  */
-void PWM1Gen2_ISR(void)
+void ResetHallRef(void)
 {
-    static const uint32_t motorID = 1;
-    MotorRunStatEnumType status = OFF;
-
-    // Create a local copy for consistency
-    uint32_t steps = MotorData[motorID].steps;
-    float speed = MotorData[motorID].speed;
-    uint32_t load = (uint32_t)(RPMtoLOAD / speed);
-
-    PWM1_2_LOAD_R = load;
-    PWM1_2_CMPA_R = load * 0.5;
+    uint32_t state = 0;
 
-    // Check if motor has moved the needed amount of steps.
-    if (steps > 0)
-    {
-        PWM1_ENABLE_R |= 0x10;
-        MOTOR1EN = 0;
-        status = RUNNING;
-        steps--;
-    }
-    else
+    for (state = 0; state < HALLNUMSTATES; state++)
     {
-        status = HALTED;
-        // Disable Load Interrupt
-        PWM1_ENABLE_R &= ~0x10;
-        PWM1_2_INTEN_R &= ~0x02;
+        HallRef.valid[state][CW] = false;
+        HallRef.valid[state][CCW] = false;
     }
+}
 
-    MotorData[motorID].runstatus = status;
-    MotorData[motorID].steps = steps;
+/* =======================================================
+ * Function Name: ClearHallMaxError
+ * =======================================================
+ * Parameters: None
+ * Return: maxerror (microsteps)
+ * Description:
+ * This function returns the largest position error seen
+ * on a hall sensor edge since the last call and clears
+ * it. An error larger than a few microsteps means the
+ * rack motor has lost steps.
+ * =======================================================
+ */
+uint32_t ClearHallMaxError(void)
+{
+    uint32_t maxerror = 0;
 
-    // Sync and Update Gen0 and Gen 1
-    PWM1_CTL_R = 0x0C;
+    // Hold off the hall sensor interrupt while clearing
+    GPIO_PORTB_IM_R &= ~HALSEN_MASK;
+    maxerror = HallRef.maxerror;
+    HallRef.maxerror = 0;
+    GPIO_PORTB_IM_R |= HALSEN_MASK;
 
-    // Clear Load Interrupt
-    PWM1_2_ISC_R |= 0x02;
+    return maxerror;
 }
 
 /* =======================================================
- * Function Name: PortBISR
+ * Function Name: GetHallHomeLatch
  * =======================================================
- * Parameters: N/A
- * Return: N/A
+ * Parameters: position
+ * Return: count
  * Description:
- * This is the GPIO Interrupt Handler for the Hall
- * Sensors. This will interrupt on either the rising
- * or falling edge of the two rack hall sensors (PB0/PB1).
- * The primary responsiblities of the interrupt handler
- * is to handle the transition of a motor home status
- * and save the data for use by the main program.
+ * This function returns the number of times the rack has
+ * entered the home position and stores the rack position
+ * (microsteps) latched on the most recent entry. A caller
+ * may compare the count to a previous reading to detect a
+ * new home edge.
  * =======================================================
  */
-void PortBISR(void)
+uint32_t GetHallHomeLatch(int32_t* position)
 {
-    uint16_t input = HALLSEN;
-    MotorHomeStatEnumType homestatus = NOTHOME;
-    
-    // If both sensor indicates a detection
-    if (input == 0)
-    {
-        homestatus = HOME;
-    }
-    else
-    {
-        // If atleast one sensor indicates
-        // a detection. Otherwise, homestatus = NOTHOME
-        if (input == 0x1 || input == 0x02)
-        {
-            homestatus = NEARHOME;
-        }
-        else
-        {
-            homestatus = NOTHOME;
-        }
-    }
+    uint32_t count = 0;
 
-    // Save the data to the rack motor dta
-    MotorData[0].homestatus = homestatus;
+    // Re-read if the interrupt latched a new edge while reading
+    do
+    {
+        count = HallRef.homecount;
+        *position = HallRef.homeposition;
+    } while (count != HallRef.homecount);
 
-    // Clear the interrupt flag.
-    GPIO_PORTB_ICR_R |= HALSEN_MASK;
+    return count;
 }
 
+/* =======================================================
+ * Function Name: GetHallRef
+ * =======================================================
+ * Parameters: None
+ * Return: HallRef
+ * Description:
+ * This is a helper function to read a copy of the hall
+ * sensor reference data, including the last measured
+ * position error and the number of corrections made.
+ * =======================================================
+ */
+HallRefStructType GetHallRef(void)
+{
+    return HallRef;
+}
+
+/* =======================================================
+ * Function Name: SetMotorProfile
+ * =======================================================
+ * Parameters: motorID, profile
+ * Return: None
+ * Description:
+ * This function sets the motion profile (ramp type,
+ * start speed, acceleration, deceleration and settle time)
+ * used by the specified motor. The profile is copied into
+ * the motor data structure and is used starting with the
+ * next commanded move. The profile should only be changed
+ * while the motor is not running.
+ * =======================================================
+ */
+void SetMotorProfile(uint32_t motorID, const MotorProfileStructType* profile)
+{
+    MotorData[motorID].profile = *profile;
+}
+
+/* =======================================================
+ * Function Name: GetMotorSettleTime
+ * =======================================================
+ * Parameters: motorID
+ * Return: settle time (microseconds)
+ * Description:
+ * This is a helper function to read the settle time of the
+ * active motion profile of a motor. This is the time the
+ * caller should allow the load to come to a full stop after
+ * the motor has halted.
+ * =======================================================
+ */
+uint32_t GetMotorSettleTime(uint32_t motorID)
+{
+    return MotorData[motorID].profile.settle;
+}
+
+#if MOTIONSTATS
+/* =======================================================
+ * Function Name: GetMotionStats
+ * =======================================================
+ * Parameters: motorID
+ * Return: MotionStats
+ * Description:
+ * This is a helper function to read a copy of the step
+ * interrupt timing histograms of a motor. The copy is
+ * taken with the motor's interrupt held off so the
+ * histograms and totals agree with each other.
+ * =======================================================
+ */
+MotionStatsStructType GetMotionStats(uint32_t motorID)
+{
+    const uint32_t irq = MotorHw[motorID].irq - 16;
+    MotionStatsStructType stats;
+
+    (&NVIC_DIS0_R)[irq >> 5] = 1 << (irq & 0x1F);
+    stats = MotionStats[motorID];
+    (&NVIC_EN0_R)[irq >> 5] = 1 << (irq & 0x1F);
+
+    return stats;
+}
+
+/* =======================================================
+ * Function Name: ClearMotionStats
+ * =======================================================
+ * Parameters: None
+ * Return: None
+ * Description:
+ * This function clears the step interrupt timing
+ * histograms of all motors. The timing state of each
+ * motor is kept so the next step is still measured.
+ * =======================================================
+ */
+void ClearMotionStats(void)
+{
+    uint32_t motorID = 0;
+    uint32_t irq = 0;
+
+    for (motorID = 0; motorID < NUMMOTORS; motorID++)
+    {
+        irq = MotorHw[motorID].irq - 16;
+
+        (&NVIC_DIS0_R)[irq >> 5] = 1 << (irq & 0x1F);
+        memset(&MotionStats[motorID], 0, sizeof(MotionStatsStructType));
+        (&NVIC_EN0_R)[irq >> 5] = 1 << (irq & 0x1F);
+    }
+}
+
+/* =======================================================
+ * Function Name: MotionStatsBin
+ * =======================================================
+ * Parameters: ticks
+ * Return: bin
+ * Description:
+ * Helper function to find the histogram bin of a time in
+ * clock ticks. Bin n holds 2^(n-1) to 2^n - 1 ticks, the
+ * last bin holds anything longer.
+ * =======================================================
+ */
+static inline uint32_t MotionStatsBin(uint32_t ticks)
+{
+    uint32_t bin = 0;
+
+    while (ticks > 0 && bin < (MSTATBINS - 1))
+    {
+        ticks >>= 1;
+        bin++;
+    }
+
+    return bin;
+}
+
+/* =======================================================
+ * Function Name: MotionStatsEntry
+ * =======================================================
+ * Parameters: motorID
+ * Return: None
+ * Description:
+ * Called first thing in the step interrupt of a motor to
+ * time it. The PWM counter counts down from the load it
+ * was reloaded with at the load event, so the ticks it has
+ * counted since give the interrupt latency. The time
+ * between two entries, less the step period that was
+ * running, is the period error (jitter) of the steps.
+ * Both the PWM generators and the time base run at
+ * SYSCLOCK. Nothing is measured after the load interrupt
+ * was turned off, as the interrupt may have been pending.
+ * =======================================================
+ */
+static inline void MotionStatsEntry(const uint32_t motorID)
+{
+    MotionStatsStructType* stats = &MotionStats[motorID];
+    MotionProbeStructType* probe = &MotionProbe[motorID];
+    uint32_t count = *MotorHw[motorID].count;
+    uint32_t entry = WTIMER0_TAV_R;     // Read directly to keep the probe short
+    uint32_t latency = 0;
+    int32_t error = 0;
+
+    if (probe->valid)
+    {
+        // The counter is reloaded with the pending load at the event
+        latency = (count <= probe->pending) ? (probe->pending - count) : 0;
+        error = (int32_t)(entry - probe->entry) - (int32_t)(probe->period + 1);
+
+        stats->latency[MotionStatsBin(latency)]++;
+        if (latency > stats->maxlatency)
+        {
+            stats->maxlatency = latency;
+        }
+
+        if (error < 0)
+        {
+            stats->error[MotionStatsBin(-error)]++;
+            stats->early++;
+        }
+        else
+        {
+            stats->error[MotionStatsBin(error)]++;
+            stats->late++;
+        }
+
+        if (error < stats->minerror)
+        {
+            stats->minerror = error;
+        }
+        if (error > stats->maxerror)
+        {
+            stats->maxerror = error;
+        }
+
+        // A whole step period late means a load event was missed
+        if (count > probe->pending || error > (int32_t)probe->period)
+        {
+            stats->overruns++;
+        }
+
+        stats->samples++;
+    }
+
+    probe->entry = entry;
+    probe->period = probe->pending;
+}
+
+/* =======================================================
+ * Function Name: MotionStatsExit
+ * =======================================================
+ * Parameters: motorID, status
+ * Return: None
+ * Description:
+ * Called last in the step interrupt of a motor to save
+ * the load it programmed for the next measurement.
+ * =======================================================
+ */
+static inline void MotionStatsExit(const uint32_t motorID, MotorRunStatEnumType status)
+{
+    MotionProbeStructType* probe = &MotionProbe[motorID];
+
+    probe->pending = *MotorHw[motorID].load;
+    probe->valid = (status == RUNNING);
+}
+#endif
+
+/* =======================================================
+ * Function Name: SpeedToLoad
+ * =======================================================
+ * Parameters: speed (Q16)
+ * Return: load
+ * Description:
+ * Helper function to convert a Q16 ramp speed into the
+ * PWM generator load value. Only integer math is used
+ * so it is safe to call from the step interrupts. The
+ * result is limited to the 16-bit PWM load register.
+ * =======================================================
+ */
+static inline uint32_t SpeedToLoad(uint32_t speed)
+{
+    uint32_t load = RPMtoLOADQ8 / (speed >> 8);
+
+    if (load > MAXPWMLOAD)
+    {
+        load = MAXPWMLOAD;
+    }
+
+    return load;
+}
+
+/* =======================================================
+ * Function Name: SCurveShape
+ * =======================================================
+ * Parameters: num, den
+ * Return: shape (Q16)
+ * Description:
+ * Helper function for the S-Curve ramp. Returns the
+ * smoothstep value 3x^2 - 2x^3 of x = num/den in Q16 by
+ * interpolating the SCurveTable. The slope of the shape is
+ * zero at both ends which limits the jerk when entering
+ * and leaving a ramp.
+ * =======================================================
+ */
+static inline uint32_t SCurveShape(uint32_t num, uint32_t den)
+{
+    uint32_t x = 0;
+    uint32_t indx = 0;
+    uint32_t frac = 0;
+
+    // Scale down long ramps so the Q16 conversion can not overflow
+    while (den > 0xFFFF)
+    {
+        num = num >> 1;
+        den = den >> 1;
+    }
+
+    if (num >= den)
+    {
+        return SCURVETBLONE;
+    }
+
+    x = (num << 16) / den;
+    indx = x >> 11;
+    frac = x & 0x7FF;
+
+    return SCurveTable[indx] + (((SCurveTable[indx + 1] - SCurveTable[indx]) * frac) >> 11);
+}
+
+/* =======================================================
+ * Function Name: RampStart
+ * =======================================================
+ * Parameters: motor
+ * Return: speed (Q16)
+ * Description:
+ * Helper function to reset the ramp state of a motor at
+ * the beginning of a new move. The move begins at the
+ * profile start speed, or at the commanded speed if it is
+ * slower than the start speed. See RampFrom.
+ * =======================================================
+ */
+static inline uint32_t RampStart(MotorDataStructType* motor)
+{
+    uint32_t max_speed = motor->speed << 16;
+    uint32_t speed = motor->profile.start;
+
+    if (speed > max_speed)
+    {
+        speed = max_speed;
+    }
+
+    RampFrom(motor, speed);
+
+    return speed;
+}
+
+/* =======================================================
+ * Function Name: MotorMoveDone
+ * =======================================================
+ * Parameters: motor, motorID
+ * Return: None
+ * Description:
+ * Helper function for the step interrupts to retire the
+ * current move once its final step has been output. This
+ * marks the move handle as done and calls the completion
+ * callback of the move if one was given.
+ * =======================================================
+ */
+static inline void MotorMoveDone(MotorDataStructType* motor, uint32_t motorID)
+{
+    MotionCallbackType callback = motor->callback;
+
+    motor->active = false;
+    motor->callback = 0;
+    motor->completed++;
+
+    if (callback)
+    {
+        callback(motorID);
+    }
+}
+
+/* =======================================================
+ * Function Name: MotorNextSegment
+ * =======================================================
+ * Parameters: motor
+ * Return: loaded
+ * Description:
+ * Helper function for the step interrupts to pull the next
+ * segment from the motor queue into the motor data once the
+ * current move has completed. The ramp continues from the
+ * current speed, and the exit speed is set if the segment
+ * after this one can be blended into it. Returns false if
+ * the queue is empty.
+ * =======================================================
+ */
+static inline bool MotorNextSegment(MotorDataStructType* motor)
+{
+    MotorQueueStructType* queue = &motor->queue;
+    MotorRampStructType* ramp = &motor->ramp;
+    MotorSegmentStructType* segment;
+    uint32_t head = queue->head;
+
+    if (head == queue->tail)
+    {
+        return false;
+    }
+
+    segment = &queue->segment[head];
+    motor->steps = segment->steps;
+    motor->direction = segment->direction;
+    motor->speed = segment->speed;
+    motor->dwell = segment->dwell;
+    motor->callback = segment->callback;
+    motor->active = true;
+
+    head = (head + 1) % MOTORQUEUESIZE;
+    queue->head = head;
+
+    // Look ahead for a segment that can be run without stopping
+    ramp->exit = 0;
+    if (motor->dwell == 0 && head != queue->tail)
+    {
+        segment = &queue->segment[head];
+        if (segment->direction == motor->direction && segment->dwell == 0)
+        {
+            ramp->exit = ((segment->speed < motor->speed) ? segment->speed : motor->speed) << 16;
+        }
+    }
+
+    // Continue accelerating from the current speed
+    RampFrom(motor, ramp->speed);
+
+    return true;
+}
+
+/* =======================================================
+ * Function Name: RampNextSpeed
+ * =======================================================
+ * Parameters: motor, steps
+ * Return: speed (Q16)
+ * Description:
+ * Ramp generator shared by the step interrupts.
+ * Steps is the number of steps left in the move including
+ * the one about to be taken. The motor accelerates towards
+ * the commanded speed until the remaining steps are only
+ * enough to decelerate back to the start speed, after which
+ * it decelerates for the rest of the move.
+ * For a trapezoidal profile the speed changes by a fixed
+ * amount each step and the commanded speed is read on
+ * every step so it may be changed while the motor is
+ * running. For an S-Curve profile the speed follows a
+ * smoothstep shape over each ramp so that the acceleration
+ * builds up and dies out gradually instead of jumping.
+ * =======================================================
+ */
+static inline uint32_t RampNextSpeed(MotorDataStructType* motor, uint32_t steps)
+{
+    MotorRampStructType* ramp = &motor->ramp;
+    MotorProfileStructType* profile = &motor->profile;
+    uint32_t max_speed = motor->speed << 16;
+    uint32_t floor = profile->start;
+    uint32_t speed = ramp->speed;
+    uint32_t decel_dist = 0;
+
+    if (floor > max_speed)
+    {
+        floor = max_speed;
+    }
+
+    // Only slow down to the entry speed of the next segment
+    // if it will continue in the same direction
+    if (ramp->exit > floor)
+    {
+        floor = ramp->exit;
+    }
+
+    // Begin decelerating once the remaining steps are within
+    // the distance needed to slow back down to the start speed
+    if (ramp->phase != RAMP_DECEL && speed > floor)
+    {
+        decel_dist = (speed - floor) / profile->decel;
+
+        if (profile->mode == PROFILE_SCURVE)
+        {
+            decel_dist = (decel_dist * 3) / 2;
+        }
+
+        if (steps <= decel_dist)
+        {
+            ramp->phase = RAMP_DECEL;
+            ramp->base = floor;
+            ramp->span = speed - floor;
+            ramp->length = steps;
+        }
+    }
+
+    if (ramp->phase == RAMP_DECEL)
+    {
+        if (profile->mode == PROFILE_SCURVE)
+        {
+            speed = ramp->base + ((ramp->span >> 8) * (SCurveShape(steps - 1, ramp->length) >> 8));
+        }
+        // Clamp before subtracting since the speed is unsigned
+        else if (speed > floor + profile->decel)
+        {
+            speed = speed - profile->decel;
+        }
+        else
+        {
+            speed = floor;
+        }
+    }
+    else if (ramp->phase == RAMP_ACCEL && profile->mode == PROFILE_SCURVE)
+    {
+        ramp->count++;
+        speed = ramp->base + ((ramp->span >> 8) * (SCurveShape(ramp->count, ramp->length) >> 8));
+
+        if (ramp->count >= ramp->length)
+        {
+            ramp->phase = RAMP_CRUISE;
+        }
+
+        if (speed > max_speed)
+        {
+            speed = max_speed;
+        }
+    }
+    else
+    {
+        if (speed < max_speed)
+        {
+            speed = speed + profile->accel;
+            ramp->phase = RAMP_ACCEL;
+        }
+        else
+        {
+            ramp->phase = RAMP_CRUISE;
+        }
+
+        // Limit to the commanded speed. This will also
+        // immediately slow the motor if the speed was lowered
+        if (speed > max_speed)
+        {
+            speed = max_speed;
+        }
+    }
+
+    ramp->speed = speed;
+
+    return speed;
+}
+
+/* =======================================================
+ * Function Name: MotorStepISR
+ * =======================================================
+ * Parameters: motorID
+ * Return: N/A
+ * Description:
+ * This is the PWM Interrupt Handler body shared by all
+ * motors. It is called with a constant motorID from the
+ * interrupt vector of each motor, so the motor table
+ * lookups are resolved when it is inlined.
+ * This will interrupt when the PWM counter is zero. The
+ * primary responsiblities of the interrupt handler is
+ * to manage the steps the motor has moved as well as 
+ * control the speed of the motor. All pertinent data
+ * is provided from the corresponding MotorData structure.
+ * The interrupt will read from this and then save the
+ * updated value.
+ * =======================================================
+ */
+static inline void MotorStepISR(const uint32_t motorID)
+{
+    const MotorHwStructType* hw = &MotorHw[motorID];
+    MotorDataStructType* motor = &MotorData[motorID];
+    MotorRunStatEnumType status = OFF;
+
+    // Create a local copy for consistency
+    uint32_t steps = motor->steps;
+    uint32_t load = 0;
+
+#if MOTIONSTATS
+    MotionStatsEntry(motorID);
+#endif
+
+    // Retire the current move and pull the next queued segment
+    if (steps == 0 && motor->dwell == 0)
+    {
+        if (motor->active)
+        {
+            MotorMoveDone(motor, motorID);
+        }
+
+        if (MotorNextSegment(motor))
+        {
+            steps = motor->steps;
+            *hw->dir = motor->direction;
+        }
+    }
+
+    if (motor->runstatus != RUNNING)
+    {
+        load = SpeedToLoad(RampStart(motor));
+        *hw->load = load;
+        *hw->cmpa = load >> 1;
+    }
+
+    if (motor->dwell > 0)
+    {
+        // Hold position with no steps until the dwell has elapsed
+        load = (motor->dwell > MAXPWMLOAD) ? MAXPWMLOAD : motor->dwell;
+        motor->dwell = motor->dwell - load;
+        *hw->load = load;
+
+        *hw->enable &= ~hw->outbit;
+        *hw->en = 0;
+        status = RUNNING;
+    }
+    // Check if motor has moved the needed amount of steps.
+    else if (steps > 0)
+    {
+        load = SpeedToLoad(RampNextSpeed(motor, steps));
+        *hw->load = load;
+        *hw->cmpa = load >> 1;
+
+        *hw->enable |= hw->outbit;
+        *hw->en = 0;
+        status = RUNNING;
+        steps--;
+
+        // Track the absolute position in microsteps
+        motor->position += (motor->direction == CW) ? 1 : -1;
+    }
+    else
+    {
+        status = HALTED;
+        // Disable Load Interrupt
+        *hw->enable &= ~hw->outbit;
+        *hw->inten &= ~0x02;
+    }
+
+    motor->runstatus = status;
+    motor->steps = steps;
+
+    // Sync and Update the Generator
+    *hw->ctl = hw->sync;
+
+#if MOTIONSTATS
+    MotionStatsExit(motorID, status);
+#endif
+
+    // Clear Load Interrupt
+    *hw->isc |= 0x02;
+}
+
+/* =======================================================
+ * Function Name: PWM0Gen0_ISR
+ * =======================================================
+ * Parameters: N/A
+ * Return: N/A
+ * Description:
+ * This is the PWM Interrupt Handler for the Rack Motor.
+ * See MotorStepISR.
+ * =======================================================
+ */
+void PWM0Gen0_ISR(void)
+{
+    MotorStepISR(0);
+}
+
+/* =======================================================
+ * Function Name: PWM1Gen2_ISR
+ * =======================================================
+ * Parameters: N/A
+ * Return: N/A
+ * Description:
+ * This is the PWM Interrupt Handler for the Auger Motor.
+ * See MotorStepISR.
+ * =======================================================
+ */
+void PWM1Gen2_ISR(void)
+{
+    MotorStepISR(1);
+}
+
+/* =======================================================
+ * Function Name: PortBISR
+ * =======================================================
+ * Parameters: N/A
+ * Return: N/A
+ * Description:
+ * This is the GPIO Interrupt Handler for the Hall
+ * Sensors. This will interrupt on either the rising
+ * or falling edge of the two rack hall sensors (PB0/PB1).
+ * The primary responsiblities of the interrupt handler
+ * is to handle the transition of a motor home status
+ * and save the data for use by the main program.
+ * =======================================================
+ */
+void PortBISR(void)
+{
+    static uint16_t input_pv = HALSEN_MASK;
+    uint16_t input = HALLSEN;
+    MotorHomeStatEnumType homestatus = NOTHOME;
+    MotorDataStructType* motor = &MotorData[0];
+    MotorDirEnumType dir = motor->direction;
+    int32_t position = motor->position;
+    int32_t error = 0;
+    
+    // If both sensor indicates a detection
+    if (input == 0)
+    {
+        homestatus = HOME;
+    }
+    else
+    {
+        // If atleast one sensor indicates
+        // a detection. Otherwise, homestatus = NOTHOME
+        if (input == 0x1 || input == 0x02)
+        {
+            homestatus = NEARHOME;
+        }
+        else
+        {
+            homestatus = NOTHOME;
+        }
+    }
+
+    // Latch the rack position on every edge while the rack is moving.
+    // The PWM interrupt has the same priority so the position
+    // and remaining steps can not change while this runs.
+    if (input != input_pv && motor->runstatus == RUNNING)
+    {
+        if (homestatus == HOME)
+        {
+            HallRef.homeposition = position;
+            HallRef.homedirection = dir;
+            HallRef.homecount++;
+        }
+
+        if (HallRef.valid[input][dir])
+        {
+            // Wrap the error to the nearest revolution
+            error = (position - HallRef.reference[input][dir]) % RACKUSTEPREV;
+            if (error > RACKUSTEPREV / 2)
+            {
+                error = error - RACKUSTEPREV;
+            }
+            else if (error < -(RACKUSTEPREV / 2))
+            {
+                error = error + RACKUSTEPREV;
+            }
+
+            HallRef.error = error;
+
+            if ((uint32_t)((error < 0) ? -error : error) > HallRef.maxerror)
+            {
+                HallRef.maxerror = (error < 0) ? -error : error;
+            }
+
+            if (error >= -HALLMAXERR && error <= HALLMAXERR)
+            {
+                // Correct the position estimate and the rest of the move
+                // so the move still ends on its target
+                motor->position = position - error;
+
+                if (dir == CCW)
+                {
+                    error = -error;
+                }
+
+                if (error < 0 && (uint32_t)(-error) > motor->steps)
+                {
+                    motor->steps = 0;
+                }
+                else
+                {
+                    motor->steps = motor->steps + error;
+                }
+
+                HallRef.corrections++;
+            }
+            else
+            {
+                // Too large to trust, leave it to the next homing
+                HallRef.rejects++;
+            }
+        }
+        else
+        {
+            // First pass over this edge, learn where it is
+            HallRef.reference[input][dir] = position;
+            HallRef.valid[input][dir] = true;
+        }
+    }
+
+    input_pv = input;
+
+    // Save the data to the rack motor dta
+    motor->homestatus = homestatus;
+
+    // Clear the interrupt flag.
+    GPIO_PORTB_ICR_R |= HALSEN_MASK;
+}
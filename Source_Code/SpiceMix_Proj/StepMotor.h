@@ -28,23 +28,70 @@
 #define MINRPM (SYSCLOCK*60)/(65535*USTEPFULL360*2)
 #define RPMtoLOAD (SYSCLOCK*60)/(USTEPFULL360*2)
 
+// Fixed-Point Speed Scaling for the Step Interrupts
+// Ramp speeds are kept in Q16 (RPM * 65536) so the ISR never
+// touches the FPU or the double precision SYSCLOCK math.
+// The PWM load is calculated with a single 32-bit divide of
+// a Q8 numerator by the Q8 speed (speed >> 8).
+#define SPEEDQ16(rpm) ((uint32_t)((rpm)*65536))
+#define MINSPEEDQ16 SPEEDQ16(MINRPM)
+#define RPMtoLOADQ8 ((uint32_t)(RPMtoLOAD)*256)
+#define MAXPWMLOAD 0xFFFF
+
+// Default Ramp Profiles (Q16)
+// Start is the speed a move begins and ends at. Accel/Decel
+// are the speed change applied on every step (Peak change
+// for an S-Curve profile). Settle is the time in microseconds
+// to let the load come to a full stop after a move.
+#define RACKSTARTQ16 MINSPEEDQ16
+#define RACKACCELQ16 SPEEDQ16(0.03125)
+#define RACKDECELQ16 SPEEDQ16(0.03125)
+#define AUGERSTARTQ16 SPEEDQ16(20)
+#define AUGERACCELQ16 SPEEDQ16(0.0625)
+#define AUGERDECELQ16 SPEEDQ16(0.0625)
+#define RACKSETTLEUS 500000
+#define AUGERSETTLEUS 10000
+
+// Motion Segment Queue
+#define MOTORQUEUESIZE 8    // Max number of pending segments per motor
+#define UStoPWMTICKS(us) ((uint32_t)(us) * (uint32_t)(SYSCLOCK / 1000000))
+#define MOTIONINVALID 0     // Ticket of a move that could not be queued
+
+// S-Curve Shape Table Size (See SCurveShape)
+#define SCURVETBLSIZE 32
+#define SCURVETBLONE 65536
+
 #define GEARRATIO 3.5 //(56/15)
+#define RACKUSTEPREV ((USTEPFULL360 * 7) / 2)       // Rack microsteps per revolution (USTEPFULL360 * GEARRATIO)
+
+// Number of stepper motors (See MotorHw in StepMotor.c)
+#define NUMMOTORS 2
 
 // Memory Alias for Motor Outputs and Hall Sensor Input
-//#define RACKMOTOR ((volatile uint32_t *)0x4000503C)		// PORTB0-3
-//#define AUGERMOTOR ((volatile uint32_t *)0x4002503C)	// PORTF0-3
-#define MOTOR0STEP	(*((volatile uint32_t *)(0x42000000 + (0x400053FC-0x40000000)*32 + 6*4)))
-#define MOTOR0DIR	(*((volatile uint32_t *)(0x42000000 + (0x400053FC-0x40000000)*32 + 7*4)))
-#define MOTOR0EN	(*((volatile uint32_t *)(0x42000000 + (0x400053FC-0x40000000)*32 + 5*4)))
-#define MOTOR1STEP	(*((volatile uint32_t *)(0x42000000 + (0x400253FC-0x40000000)*32 + 0*4)))
-#define MOTOR1DIR	(*((volatile uint32_t *)(0x42000000 + (0x400253FC-0x40000000)*32 + 1*4)))
-#define MOTOR1EN	(*((volatile uint32_t *)(0x42000000 + (0x400253FC-0x40000000)*32 + 2*4)))
+// BITBAND gives the bit-band alias of a single GPIO data bit
+// and MOTORREG the address of a register for the motor table.
+#define BITBAND(port, bit) ((volatile uint32_t *)(0x42000000 + ((port) + 0x3FC - 0x40000000)*32 + (bit)*4))
+#define MOTORREG(reg) ((volatile uint32_t *) &(reg))
 
 #define HALLSEN (*((volatile uint32_t *)0x4000500C))		// PORTB0/1
 
 // Mask
 #define HALSEN_MASK 0x03
 
+// Hall Sensor Re-referencing
+#define HALLNUMSTATES 4                 // Sensor input combinations (PB0/PB1)
+#define HALLMAXERR (RACKUSTEPREV / 32)  // Largest error (microsteps) that is corrected
+
+// Step Timing Instrumentation (See MotionStatsEntry)
+// Build with MOTIONSTATS set to 1 to time every step interrupt
+// against the free-running time base. Bin n of a histogram counts
+// the samples of 2^(n-1) to 2^n - 1 clock ticks (Bin 0 = 0 ticks)
+// and the last bin also counts anything longer.
+#ifndef MOTIONSTATS
+	#define MOTIONSTATS 0
+#endif
+#define MSTATBINS 16
+
 
 /*========================================================
  * Variable Definitions
@@ -71,18 +118,158 @@ typedef enum
 	CCW
 }MotorDirEnumType;
 
+typedef enum
+{
+	RAMP_ACCEL,
+	RAMP_CRUISE,
+	RAMP_DECEL
+}MotorRampPhaseEnumType;
+
+typedef enum
+{
+	PROFILE_TRAP,
+	PROFILE_SCURVE
+}MotorProfileModeEnumType;
+
+// Motion profile limits of a motor (All speeds are Q16)
+typedef struct
+{
+	MotorProfileModeEnumType mode;
+	uint32_t start;
+	uint32_t accel;
+	uint32_t decel;
+	uint32_t settle;
+}MotorProfileStructType;
+
+// Ramp state of a motor. Owned by the motor's PWM interrupt.
+typedef struct
+{
+	MotorRampPhaseEnumType phase;
+	uint32_t speed;
+	uint32_t base;
+	uint32_t span;
+	uint32_t count;
+	uint32_t length;
+	uint32_t exit;
+}MotorRampStructType;
+
+// Completion callback of a move. Called from the motor's PWM
+// interrupt so it must be short and must not block.
+typedef void (*MotionCallbackType)(uint32_t motorID);
+
+// Handle to a commanded or queued move. The ticket is the
+// sequence number of the move on that motor.
+typedef struct
+{
+	uint32_t motorID;
+	uint32_t ticket;
+}MotionHandleType;
+
+// A single queued move. Dwell is the time to wait (in PWM
+// clock ticks) before the segment begins moving.
+typedef struct
+{
+	uint32_t steps;
+	MotorDirEnumType direction;
+	uint16_t speed;
+	uint32_t dwell;
+	MotionCallbackType callback;
+}MotorSegmentStructType;
+
+// Ring buffer of pending segments. Head is only written by the
+// motor's PWM interrupt and tail only by the main program.
+typedef struct
+{
+	MotorSegmentStructType segment[MOTORQUEUESIZE];
+	volatile uint8_t head;
+	volatile uint8_t tail;
+}MotorQueueStructType;
+
+// Hardware of a stepper motor. The step output is driven by
+// output A of a PWM generator, the load interrupt of the
+// generator runs the motor. See MotorStepISR.
+typedef struct
+{
+	volatile uint32_t* load;        // PWMn_g_LOAD_R
+	volatile uint32_t* cmpa;        // PWMn_g_CMPA_R
+	volatile uint32_t* genctl;      // PWMn_g_CTL_R
+	volatile uint32_t* gena;        // PWMn_g_GENA_R
+	volatile uint32_t* inten;       // PWMn_g_INTEN_R
+	volatile uint32_t* isc;         // PWMn_g_ISC_R
+	volatile uint32_t* modinten;    // PWMn_INTEN_R
+	volatile uint32_t* enable;      // PWMn_ENABLE_R
+	volatile uint32_t* ctl;         // PWMn_CTL_R
+	uint32_t genbit;                // Generator bit in PWMn_INTEN_R
+	uint32_t outbit;                // Output bit in PWMn_ENABLE_R
+	uint32_t sync;                  // Generators updated by PWMn_CTL_R
+	uint32_t irq;                   // Interrupt number of the generator
+	volatile uint32_t* dir;         // Direction pin (bit-band alias)
+	volatile uint32_t* en;          // Driver enable pin, active low (bit-band alias)
+	volatile uint32_t* count;       // PWMn_g_COUNT_R
+}MotorHwStructType;
+
 typedef struct
 {
-	MotorRunStatEnumType runstatus;
+	volatile MotorRunStatEnumType runstatus;
 	MotorDirEnumType direction;
 	MotorHomeStatEnumType homestatus;
 	uint32_t steps;
-	float position;
+	volatile int32_t position;
 	uint32_t speed;
+	MotorProfileStructType profile;
+	MotorRampStructType ramp;
+	uint32_t dwell;
+	bool active;
+	MotionCallbackType callback;
+	uint32_t issued;
+	volatile uint32_t completed;
+	MotorQueueStructType queue;
 }MotorDataStructType;
 
 
 
+// Rack position reference learnt from the hall sensor edges.
+// An edge is identified by the sensor input after the edge and
+// the direction the rack was moving.
+typedef struct
+{
+	bool valid[HALLNUMSTATES][2];
+	int32_t reference[HALLNUMSTATES][2];
+	volatile uint32_t homecount;
+	volatile int32_t homeposition;
+	volatile MotorDirEnumType homedirection;
+	volatile int32_t error;
+	volatile uint32_t maxerror;
+	volatile uint32_t corrections;
+	volatile uint32_t rejects;
+}HallRefStructType;
+
+// Step interrupt timing of a motor. Latency is the time from
+// the PWM load event to the interrupt entry. Period error is the
+// time between two interrupt entries less the programmed step
+// period, binned by size with early/late counts kept apart.
+typedef struct
+{
+	uint32_t latency[MSTATBINS];
+	uint32_t error[MSTATBINS];
+	uint32_t samples;
+	uint32_t early;
+	uint32_t late;
+	uint32_t overruns;
+	uint32_t maxlatency;
+	int32_t minerror;
+	int32_t maxerror;
+}MotionStatsStructType;
+
+// Step interrupt timing state of a motor (See MotionStatsEntry)
+typedef struct
+{
+	uint32_t entry;         // Time base at the last interrupt entry
+	uint32_t period;        // Load running until the next load event
+	uint32_t pending;       // Load written by the last interrupt
+	bool valid;             // Last interrupt left the load interrupt on
+}MotionProbeStructType;
+
 /*========================================================
  * Function Declarations
  *========================================================
@@ -90,8 +277,25 @@ typedef struct
 extern void StepMotorInit(void);
 extern void HallSensorInit(void);
 extern void SetMotorSpd(uint32_t motorID, uint16_t speed);
-extern void CommandMotor(uint32_t motorID, int32_t microsteps, uint16_t speed);
+extern MotionHandleType CommandMotor(uint32_t motorID, int32_t microsteps, uint16_t speed);
+extern MotionHandleType QueueMotorSegment(uint32_t motorID, int32_t microsteps, uint16_t speed, uint32_t dwell_us, MotionCallbackType callback);
+extern bool IsMotionDone(MotionHandleType handle);
+extern void WaitMotion(MotionHandleType handle);
 extern void TurnOffMotor(uint32_t motorID);
+extern void StopMotorMove(uint32_t motorID);
 extern MotorRunStatEnumType GetMotorRunStatus(uint32_t motorID);
 extern MotorHomeStatEnumType GetMotorHomeStatus(uint32_t motorID);
+extern uint32_t GetHallInput(void);
+extern void ResetHallRef(void);
+extern uint32_t ClearHallMaxError(void);
+extern uint32_t GetHallHomeLatch(int32_t* position);
+extern HallRefStructType GetHallRef(void);
+extern int32_t GetMotorPosition(uint32_t motorID);
+extern void SetMotorPosition(uint32_t motorID, int32_t position);
+extern void SetMotorProfile(uint32_t motorID, const MotorProfileStructType* profile);
+extern uint32_t GetMotorSettleTime(uint32_t motorID);
+#if MOTIONSTATS
+extern MotionStatsStructType GetMotionStats(uint32_t motorID);
+extern void ClearMotionStats(void);
+#endif
 #endif /* STEPMOTOR_H_ */
@@ -27,5 +27,77 @@ void System_Init(void)
 
     // Set GPIO ports to use APB (not needed since default configuration -- for clarity)
     SYSCTL_GPIOHBCTL_R = 0;
+
+    // Start the free running time base used for deadlines
+    TimeBaseInit();
+}
+
+
+/*=======================================================
+ * Function Name: TimeBaseInit
+ *=======================================================
+ * Parameters: None
+ * Description:
+ * This function initializes Wide-Timer 0A as a free
+ * running 32-bit up counter clocked at the system clock.
+ * It is used as the time base for non-blocking delays
+ * and deadlines.
+ *=======================================================
+ */
+void TimeBaseInit(void)
+{
+    SYSCTL_RCGCWTIMER_R |= SYSCTL_RCGCWTIMER_R0;
+    _delay_cycles(3);
+
+    WTIMER0_CTL_R &= ~TIMER_CTL_TAEN;                   // Disable Timer for Config
+    WTIMER0_CFG_R = 0x04;                               // Configure Wide-Timer as 32-Bit
+    WTIMER0_TAMR_R = TIMER_TAMR_TAMR_PERIOD | TIMER_TAMR_TACDIR; // Periodic count up
+    WTIMER0_TAILR_R = 0xFFFFFFFF;                       // Count the full 32-bits
+    WTIMER0_TAV_R = 0;                                  // Set Initial Value to 0
+    WTIMER0_CTL_R |= TIMER_CTL_TAEN;                    // Enable the timer
+}
+
+/*=======================================================
+ * Function Name: GetTimeBase
+ *=======================================================
+ * Parameters: None
+ * Return: ticks
+ * Description:
+ * Returns the current value of the free running time
+ * base in system clock ticks.
+ *=======================================================
+ */
+uint32_t GetTimeBase(void)
+{
+    return WTIMER0_TAV_R;
+}
+
+/*=======================================================
+ * Function Name: TimeBaseExpired
+ *=======================================================
+ * Parameters: deadline
+ * Return: expired
+ * Description:
+ * Returns true once the time base has reached the given
+ * deadline (in ticks). The signed difference keeps the
+ * comparison correct across a wrap of the counter.
+ *=======================================================
+ */
+bool TimeBaseExpired(uint32_t deadline)
+{
+    return (int32_t)(GetTimeBase() - deadline) >= 0;
 }
 
+/*=======================================================
+ * Function Name: WaitUntil
+ *=======================================================
+ * Parameters: deadline
+ * Description:
+ * Blocks until the time base has reached the given
+ * deadline (in ticks).
+ *=======================================================
+ */
+void WaitUntil(uint32_t deadline)
+{
+    while (!TimeBaseExpired(deadline));
+}
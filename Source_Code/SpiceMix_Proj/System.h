@@ -8,6 +8,8 @@
 #ifndef SYSTEM_H_
 #define SYSTEM_H_
 
+#include <stdbool.h>
+#include <stdint.h>
 #include "tm4c123gh6pm.h"
 
 /*========================================================
@@ -19,6 +21,12 @@
 	#define SYSCLOCK 40e6	// System Clock Frequency (Change as needed)
 #endif
 
+// Free-running time base (Wide-Timer 0A counting at SYSCLOCK)
+// Wraps every 2^32 clocks (~107s @ 40MHz), only compare times
+// through TimeBaseExpired() or a signed difference.
+#define TICKSPERUS ((uint32_t)(SYSCLOCK / 1000000))
+#define UStoTICKS(us) ((uint32_t)(us) * TICKSPERUS)
+
 /*========================================================
  * Variable Declarations
  *========================================================
@@ -29,5 +37,9 @@
  *========================================================
  */
 extern void System_Init(void);
+extern void TimeBaseInit(void);
+extern uint32_t GetTimeBase(void);
+extern bool TimeBaseExpired(uint32_t deadline);
+extern void WaitUntil(uint32_t deadline);
 
 #endif /* SYSTEM_H_ */
@@ -16,6 +16,7 @@
 #include <stdint.h>
 #include "tm4c123gh6pm.h"
 #include "MotorControl.h"
+#include "Servo.h"
 
 #include <stdio.h>
 #include <ctype.h>
@@ -129,13 +130,105 @@ void getUserInput(USER_DATA* data)
 	parseFields(data);
 }
 
+uint8_t slotSearch(USER_DATA* data, uint8_t field)
+{
+    char* str = getFieldString(data, field);
+    int32_t position = getFieldInteger(data, field);
+
+    // A slot number selects that slot, a name the first slot holding it
+    if (isDigitString(str) && position < RACK_SLOTS)
+    {
+        return (uint8_t) position;
+    }
+
+    return nameSearch(str, SpiceList, RACK_SLOTS);
+}
+
+uint16_t spiceRemQty(uint8_t spice, uint16_t remaining[])
+{
+    uint8_t i = 0;
+    uint16_t total = 0;
+
+    for (i = 0; i < RACK_SLOTS; i++)
+    {
+        if (strcmp(SpiceList[i], SpiceList[spice]) == 0)
+        {
+            total += remaining[i];
+        }
+    }
+
+    return total;
+}
+
+uint8_t planSpiceDose(uint8_t spice, uint16_t quantity, int32_t* rack, uint16_t remaining[], SpiceDataType plan[], uint8_t size)
+{
+    uint8_t i = 0;
+    uint8_t count = 0;
+    uint8_t best = ERRORMATCH;
+    uint8_t pass = 0;
+    uint16_t amount = 0;
+    uint32_t distance = 0;
+    uint32_t best_distance = 0;
+
+    while (quantity > 0 && count < size)
+    {
+        // Pass 0: Nearest slot holding the whole dose
+        // Pass 1: Nearest slot holding any of the spice (the dose is split)
+        // Pass 2: Nearest slot at all, the user chose to dispense anyways
+        best = ERRORMATCH;
+
+        for (pass = 0; pass < 3 && best == ERRORMATCH; pass++)
+        {
+            for (i = 0; i < RACK_SLOTS; i++)
+            {
+                if (strcmp(SpiceList[i], SpiceList[spice]) != 0 ||
+                    (pass == 0 && remaining[i] < quantity) ||
+                    (pass == 1 && remaining[i] == 0))
+                {
+                    continue;
+                }
+
+                distance = SlotDistance(*rack, i);
+
+                if (best == ERRORMATCH || distance < best_distance)
+                {
+                    best = i;
+                    best_distance = distance;
+                }
+            }
+        }
+
+        if (best == ERRORMATCH)
+        {
+            break;
+        }
+
+        // The last pass keeps the rest of the dose
+        amount = (pass == 3 || remaining[best] >= quantity) ? quantity : remaining[best];
+
+        plan[count].DataBits.position = best;
+        plan[count].DataBits.quantity = amount;
+        count++;
+
+        remaining[best] = (remaining[best] > amount) ? remaining[best] - amount : 0;
+        quantity = quantity - amount;
+        *rack = SLOT_USTEPS[best];
+    }
+
+    return count;
+}
+
 void dispenseSpice(USER_DATA* data)
 {
+    uint8_t i = 0;
+    uint8_t count = 0;
     uint8_t position = ERRORMATCH;
     uint16_t req_amount = (uint16_t)getFieldInteger(data, 2);
-    uint16_t rem_amount = 0;
+    uint16_t remaining[MAXSLOTS] = { 0, };
+    int32_t rack = GetMotorPosition(RACK);
+    SpiceDataType plan[MAXDOSEITEMS];
 
-    position = nameSearch(getFieldString(data, 1), SpiceList, MAXSLOTS);
+    position = nameSearch(getFieldString(data, 1), SpiceList, RACK_SLOTS);
 
     if (position == ERRORMATCH)
     {
@@ -144,10 +237,13 @@ void dispenseSpice(USER_DATA* data)
         return;
     }
 
-    rem_amount = Read_SpiceRemQty(position);
+    for (i = 0; i < RACK_SLOTS; i++)
+    {
+        remaining[i] = Read_SpiceRemQty(i);
+    }
 
-    // Check if there is enough spice left
-    if (rem_amount < req_amount)
+    // Check if there is enough spice left in all slots holding it
+    if (spiceRemQty(position, remaining) < req_amount)
     {
         putsUart0("====================== NOTICE ======================\n");
         putsUart0("There is not enough spice for the requested amount\n");
@@ -160,18 +256,32 @@ void dispenseSpice(USER_DATA* data)
             putsUart0("Canceling...\n");
             return;
         }
-        else
-        {
-            Write_SpiceRemQty(position, 0);
-        }
     }
-    else
+
+    count = planSpiceDose(position, req_amount, &rack, remaining, plan, MAXDOSEITEMS);
+
+    putsUart0("Dispensing Please Wait...\n");
+
+    for (i = 0; i < count; i++)
     {
-        Write_SpiceRemQty(position, rem_amount - req_amount);
+        // Start the motors first so the quantity update runs while dispensing
+        StartDispenseNext(plan[i].DataBits.position, plan[i].DataBits.quantity,
+                          (i + 1 < count) ? plan[i + 1].DataBits.position : DISPNEXTNONE);
+        Write_SpiceRemQty(plan[i].DataBits.position, remaining[plan[i].DataBits.position]);
+
+        if (count > 1)
+        {
+            putsUart0("- Slot ");
+            putsUart0(rusty_itoa(plan[i].DataBits.position));
+            putsUart0("\n");
+        }
+
+        // The quantities are written back once the command completes
+        // so no EEPROM write holds up the motors (See Flush_SpiceRemQty)
+        while (!DispenseTask());
     }
 
-    putsUart0("Dispensing Please Wait...\n");
-    DispenseSequence(position, req_amount);
+    DispenseFlush();
     putsUart0("Command completed\n");
 }
 
@@ -179,11 +289,18 @@ void dispenseRecipe(USER_DATA* data)
 {
     //recipe <name>
     uint8_t i = 0;
+    uint8_t count = 0;
     uint8_t position = ERRORMATCH;
     uint16_t num_of_stored_recipes = Read_NumofRecipes();
-    uint16_t rem_amount = 0;
-    // Array used to temporarily store the requested qtys of each
-    uint16_t qtys[MAXSLOTS] = { 0, };
+    bool reorder = true;
+    uint16_t remaining[MAXSLOTS] = { 0, };
+    int32_t rack = GetMotorPosition(RACK);
+    uint32_t start = 0;
+    uint32_t elapsed_ms = 0;
+    uint32_t predicted_ms = 0;
+    char str[MAX_CHARS];
+    // Doses of the recipe after each spice is split over the slots holding it
+    SpiceDataType plan[MAXDOSEITEMS];
 
     position = nameSearch(getFieldString(data, 1), RecipeList, num_of_stored_recipes);
 
@@ -196,6 +313,19 @@ void dispenseRecipe(USER_DATA* data)
 
     RecipeStructType target = Read_Recipe(position);
 
+    // Visit the slots in the fastest order unless asked to keep the saved order
+    reorder = (data->fieldCount < 3 || strcmp(getFieldString(data, 2), "asis") != 0);
+
+    if (reorder)
+    {
+        PlanDoseOrder(target.Data, MAXSLOTS, rack);
+    }
+
+    for (i = 0; i < RACK_SLOTS; i++)
+    {
+        remaining[i] = Read_SpiceRemQty(i);
+    }
+
     // Verify there is enough of each spice. Otherwise abort
     for (i = 0; i < MAXSLOTS; i++)
     {
@@ -204,11 +334,17 @@ void dispenseRecipe(USER_DATA* data)
             break;
         }
 
-        // Read the remaining quantity
-        rem_amount = Read_SpiceRemQty(target.Data[i].DataBits.position);
+        // The slot may have been removed from the carousel since the recipe was saved
+        if (target.Data[i].DataBits.position > RACK_SLOTS - 1)
+        {
+            putsUart0("====================== ERROR ======================\n");
+            putsUart0("The recipe uses a slot that is not on the carousel.\n");
+            putsUart0("Check the number of slots or save the recipe again\n");
+            return;
+        }
 
         // If there is not enough spice notify user if they would like to override
-        if (rem_amount < target.Data[i].DataBits.quantity)
+        if (spiceRemQty(target.Data[i].DataBits.position, remaining) < target.Data[i].DataBits.quantity)
         {
             putsUart0("====================== NOTICE ======================\n");
             putsUart0("There is not enough ");
@@ -223,27 +359,57 @@ void dispenseRecipe(USER_DATA* data)
                 putsUart0("Canceling...\n");
                 return;
             }
-
-            // Write remaining amount to 0
-            qtys[i] = 0;
-        }
-        else
-        {
-            // Update the remaining quantity
-            qtys[i] = rem_amount - target.Data[i].DataBits.quantity;
         }
+
+        // Pick the slots from where the rack will be after the previous spice
+        count += planSpiceDose(target.Data[i].DataBits.position, target.Data[i].DataBits.quantity,
+                               &rack, remaining, plan + count, MAXDOSEITEMS - count);
     }
 
-    putsUart0("Dispensing Please Wait...\n");
-    for (i = 0; i < MAXSLOTS; i++)
+    // The slots chosen for split doses may change the best order
+    if (reorder)
     {
-        if (target.Data[i].DataBits.quantity == 0)
-        {
-            break;
-        }
+        PlanDoseOrder(plan, count, GetMotorPosition(RACK));
+    }
 
-        DispenseSequence(target.Data[i].DataBits.position, target.Data[i].DataBits.quantity);
-        Write_SpiceRemQty(target.Data[i].DataBits.position, qtys[i]);
+    predicted_ms = EstimateRecipeUS(plan, count, rack_pos) / 1000;
+    sprintf(str, "Dispensing Please Wait... (Estimated %lu ms)\n", (unsigned long) predicted_ms);
+    putsUart0(str);
+
+    // Overlap the clutch release of each item with the next rack move
+    SetDispensePipeline(true);
+
+    for (i = 0; i < count; i++)
+    {
+        start = GetTimeBase();
+
+        // Start the motors first so the quantity update and UART
+        // output run while the item is being dispensed
+        StartDispenseNext(plan[i].DataBits.position, plan[i].DataBits.quantity,
+                          (i + 1 < count) ? plan[i + 1].DataBits.position : DISPNEXTNONE);
+        putsUart0("- ");
+        putsUart0(SpiceList[plan[i].DataBits.position]);
+        putsUart0("\n");
+        Write_SpiceRemQty(plan[i].DataBits.position, remaining[plan[i].DataBits.position]);
+
+        // The quantities are written back once the command completes
+        // so no EEPROM write holds up the motors (See Flush_SpiceRemQty)
+        while (!DispenseTask());
+        elapsed_ms += (GetTimeBase() - start) / UStoTICKS(1000);
+    }
+
+    // Let the last clutch release complete
+    start = GetTimeBase();
+    DispenseFlush();
+    SetDispensePipeline(false);
+    elapsed_ms += (GetTimeBase() - start) / UStoTICKS(1000);
+
+    if (i != 0)
+    {
+        sprintf(str, "Dispensed %d items in %lu ms (%lu ms per item)\n", i, (unsigned long) elapsed_ms, (unsigned long) (elapsed_ms / i));
+        putsUart0(str);
+        sprintf(str, "Predicted %lu ms, actual was %ld ms from the estimate\n", (unsigned long) predicted_ms, (long) elapsed_ms - (long) predicted_ms);
+        putsUart0(str);
     }
 
     putsUart0("Command completed\n");
@@ -364,7 +530,7 @@ void saveRecipe(USER_DATA* data)
             }
         }
 
-        position = nameSearch(getFieldString(data, 0), SpiceList, MAXSLOTS);
+        position = nameSearch(getFieldString(data, 0), SpiceList, RACK_SLOTS);
 
         if (position == 255)
         {
@@ -409,6 +575,19 @@ void saveRecipe(USER_DATA* data)
         }
     }
 
+    // Offer to save the spices in the order with the least rack travel from home
+    if (index > 1)
+    {
+        putsUart0("Type order to sort the spices for the least rack travel\n");
+        putsUart0("or press any key to keep the entered order: ");
+        getUserInput(data);
+
+        if (strcmp(getFieldString(data, 0), "order") == 0)
+        {
+            PlanDoseOrder(recipe.Data, index, 0);
+        }
+    }
+
     // Check if the recipe is empty. 
     if (recipe.Data[0].DataBits.quantity != 0)
     {
@@ -444,6 +623,49 @@ void saveRecipe(USER_DATA* data)
     putsUart0("Command completed\n");
 }
 
+void initEepromData(void)
+{
+    uint8_t i = 0;
+    uint16_t error = 0;
+
+    switch (Read_EEPROMLayout())
+    {
+    case LAYOUT_OLD:
+        putsUart0("Moving the stored spices and recipes to the new EEPROM layout...\n");
+        break;
+    case LAYOUT_UNKNOWN:
+        putsUart0("====================== WARNING ======================\n");
+        putsUart0("The EEPROM layout was not recognized. All spices,\n");
+        putsUart0("calibrations and recipes are reset to the defaults.\n");
+        break;
+    default:
+        break;
+    }
+
+    error = initSpiceData(false);
+
+    if (error != 0)
+    {
+        putsUart0("====================== WARNING ======================\n");
+        putsUart0("There was an issue loading the EEPROM\n");
+        putsUart0("Restart the system to try again\n");
+    }
+
+    if (Read_NumDroppedRecipes() != 0)
+    {
+        putsUart0("====================== WARNING ======================\n");
+        putsUart0("These recipes did not fit the new EEPROM layout\n");
+        putsUart0("and were removed:\n");
+
+        for (i = 0; i < Read_NumDroppedRecipes(); i++)
+        {
+            putsUart0("    ");
+            putsUart0((char*) Read_DroppedRecipe(i));
+            putsUart0("\n");
+        }
+    }
+}
+
 void initSpiceList(void)
 {
     int i = 0;
@@ -471,8 +693,10 @@ void refillSpice(USER_DATA* data)
     uint8_t position = ERRORMATCH;
     uint16_t error = 0;
     uint16_t req_amount = (uint16_t)getFieldInteger(data, 2);
+    uint16_t rem_amount = 0;
+    uint8_t i = 0;
 
-    position = nameSearch(getFieldString(data, 1), SpiceList, MAXSLOTS);
+    position = slotSearch(data, 1);
 
     if (position == ERRORMATCH)
     {
@@ -481,6 +705,25 @@ void refillSpice(USER_DATA* data)
         return;
     }
 
+    // A spice held in several slots refills the emptiest of them
+    if (!isDigitString(getFieldString(data, 1)))
+    {
+        rem_amount = Read_SpiceRemQty(position);
+
+        for (i = position + 1; i < RACK_SLOTS; i++)
+        {
+            if (strcmp(SpiceList[i], SpiceList[position]) == 0 && Read_SpiceRemQty(i) < rem_amount)
+            {
+                position = i;
+                rem_amount = Read_SpiceRemQty(i);
+            }
+        }
+
+        putsUart0("Refilling slot ");
+        putsUart0(rusty_itoa(position));
+        putsUart0("\n");
+    }
+
     if (req_amount > MAXQTY)
     {
         putsUart0("====================== NOTICE ======================\n");
@@ -489,6 +732,7 @@ void refillSpice(USER_DATA* data)
     }
 
     error = Write_SpiceRemQty(position, req_amount);
+    error |= Flush_SpiceRemQty();
 
     if (error)
     {
@@ -519,7 +763,7 @@ void changeSpice(USER_DATA* data)
         case 0: // Ask the user for the slot they'd like to change
         {
             putsUart0("Please Enter a slot number (0-");
-            strcpy(str, rusty_itoa(MAXSLOTS - 1));
+            strcpy(str, rusty_itoa(RACK_SLOTS - 1));
             putsUart0(str);
             putsUart0(") to change (or cancel to return): ");
             getUserInput(data);
@@ -537,7 +781,7 @@ void changeSpice(USER_DATA* data)
                 strcpy(str, getFieldString(data, 0));
                 position = getFieldInteger(data, 0);
 
-                if (!isDigitString(str) || position >= MAXSLOTS)
+                if (!isDigitString(str) || position >= RACK_SLOTS)
                 {
                     putsUart0("====================== ERROR ======================\n");
                     putsUart0("The slot you entered is out of range. Please try again...\n\n");
@@ -661,6 +905,7 @@ void changeSpice(USER_DATA* data)
             }
 
             error = Write_SpiceRemQty(position, req_amount);
+            error |= Flush_SpiceRemQty();
 
             if (error)
             {
@@ -684,7 +929,7 @@ void changeSpice(USER_DATA* data)
     putsUart0("Command completed\n");
 }
 
-void UIRackHome(void)
+uint16_t UIRackHome(void)
 {
     uint16_t error = 0;
 
@@ -703,11 +948,12 @@ void UIRackHome(void)
     }
 
     putsUart0("Command completed\n");
+
+    return error;
 }
 
 void deleteRecipe(USER_DATA* data)
 {
-    RecipeStructType recipe;
     uint8_t i = 0;
     uint8_t index = 0;
     uint8_t number = 255;
@@ -740,32 +986,32 @@ void deleteRecipe(USER_DATA* data)
 
         num_recipes = Read_NumofRecipes();
 
-        // This is an awful way of doing this but couldn't think
-        // of a better way without getting too convoluted.
-        // If a recipe is being deleted from the middle of the blocks
-        // we must copy and move up each recipe below it...
-        for (index = number; index < num_recipes; index++)
-        {
-            error = Delete_Recipe(index);
+        // Only the recipe directory changes, no recipes are moved
+        error = Delete_Recipe(number);
 
-            // Update the Recipe Dictionary
-            for (i = 0; i < MAXNAMESIZE; i++)
+        // Update the Recipe Dictionary
+        if (error == 0)
+        {
+            for (index = number; index + 1 < num_recipes; index++)
             {
-                *(RecipeList[index] + i) = '\0';
+                strcpy(RecipeList[index], RecipeList[index + 1]);
             }
 
-            // Perform delete and copy if the deleted recipe
-            // is not at the end of the stored recipe block
-            if(index + 1 != num_recipes)
+            for (i = 0; i < MAXNAMESIZE; i++)
             {
-                recipe = Read_Recipe(index +1);
-                error = Write_RecipeX(recipe, index);
-
-                strcpy(RecipeList[index], (char*)recipe.Name);
+                *(RecipeList[num_recipes - 1] + i) = '\0';
             }
         }
+        else
+        {
+            // The stored recipes may have changed, read them back
+            for (i = 0; i < MAXNAMESIZE; i++)
+            {
+                *(RecipeList[num_recipes - 1] + i) = '\0';
+            }
 
-        error = Update_NumRecipes(num_recipes - 1);
+            initRecipeList();
+        }
 
         if (error)
         {
@@ -842,7 +1088,7 @@ void displaySpices(void)
     putsUart0("Here are all the current spices and the remaining quantities.\n");
     putsUart0("Note: All quantities shown are half-teaspoons.\n");
 
-    for (i = 0; i < MAXSLOTS; i++)
+    for (i = 0; i < RACK_SLOTS; i++)
     {
         rem_amount = Read_SpiceRemQty(i);
         strcpy(str, rusty_itoa(i));
@@ -884,7 +1130,537 @@ void displayRecipes(void)
     }
 }
 
+void initDoseCalib(void)
+{
+    uint8_t i = 0;
+    AugerCalibType calib;
+
+    for (i = 0; i < MAXSLOTS; i++)
+    {
+        DOSE_USTEPS[i] = Read_DoseCalib(i);
+
+        calib = Read_AugerCalib(i);
+        AUGER_SPEED[i] = calib.DataBits.speed;
+        AUGER_RAMP[i] = calib.DataBits.ramp;
+    }
+}
+
+void augerProfile(USER_DATA* data)
+{
+    //auger <spice> [<speed> [<ramp>]]
+    uint8_t position = ERRORMATCH;
+    uint16_t speed = 0;
+    uint16_t ramp = 0;
+    uint16_t error = 0;
+    AugerCalibType calib;
+    char str[MAX_CHARS];
+
+    position = slotSearch(data, 1);
+
+    if (position == ERRORMATCH)
+    {
+        putsUart0("The spice you entered does not exists\n");
+        putsUart0("Use view Spices command to see a list of stored spices\n");
+        return;
+    }
+
+    // Only display the profile if no new values were given. The
+    // stored ramp rate is kept if only the speed is given
+    if (data->fieldCount >= 3)
+    {
+        speed = (uint16_t)getFieldInteger(data, 2);
+        ramp = (data->fieldCount >= 4) ? (uint16_t)getFieldInteger(data, 3) : AUGER_RAMP[position];
+
+        if (speed == 0 || speed > AUGERMAXSPD || ramp == 0 || ramp > AUGERMAXRAMP)
+        {
+            putsUart0("====================== ERROR ======================\n");
+            putsUart0("The speed must be between 1 and ");
+            strcpy(str, rusty_itoa(AUGERMAXSPD));
+            putsUart0(str);
+            putsUart0(" RPM and the ramp rate between 1 and ");
+            strcpy(str, rusty_itoa(AUGERMAXRAMP));
+            putsUart0(str);
+            putsUart0(" RPM per rotation\n");
+            return;
+        }
+
+        calib.DataBits.speed = speed;
+        calib.DataBits.ramp = ramp;
+        error = Write_AugerCalib(position, calib);
+        AUGER_SPEED[position] = speed;
+        AUGER_RAMP[position] = ramp;
+
+        if (error)
+        {
+            putsUart0("====================== WARNING ======================\n");
+            putsUart0("There was an issue saving the profile to the EEPROM\n");
+            putsUart0("You may try again or reset the system\n");
+        }
+    }
+
+    putsUart0(SpiceList[position]);
+    putsUart0(" auger speed: ");
+    strcpy(str, rusty_itoa(AUGER_SPEED[position]));
+    putsUart0(str);
+    putsUart0(" RPM, ramp rate: ");
+    strcpy(str, rusty_itoa(AUGER_RAMP[position]));
+    putsUart0(str);
+    putsUart0(" RPM per rotation\n");
+    putsUart0("Command completed\n");
+}
+
 void calibrate(USER_DATA* data)
 {
+    //calibrate <spice> <rotations>
+    uint8_t position = ERRORMATCH;
+    uint16_t rotations = (uint16_t)getFieldInteger(data, 2);
+    uint16_t measured = 0;
+    uint16_t rem_amount = 0;
+    uint32_t microsteps = 0;
+    uint16_t error = 0;
+    char str[MAX_CHARS];
+
+    position = slotSearch(data, 1);
+
+    if (position == ERRORMATCH)
+    {
+        putsUart0("The spice you entered does not exists\n");
+        putsUart0("Use view Spices command to see a list of stored spices\n");
+        return;
+    }
+
+    if (rotations == 0 || rotations > CALIBMAXROT)
+    {
+        putsUart0("====================== ERROR ======================\n");
+        putsUart0("The number of rotations must be between 1 and ");
+        strcpy(str, rusty_itoa(CALIBMAXROT));
+        putsUart0(str);
+        putsUart0("\n");
+        return;
+    }
+
+    putsUart0("Current calibration of ");
+    putsUart0(SpiceList[position]);
+    putsUart0(" is ");
+    strcpy(str, rusty_itoa(DOSE_USTEPS[position]));
+    putsUart0(str);
+    putsUart0(" microsteps per half-teaspoon\n");
+    putsUart0("Place a measuring spoon under the dispenser.\n");
+    putsUart0("Press any key to continue or type cancel to return: ");
+    getUserInput(data);
+
+    if (strcmp(getFieldString(data, 0), "cancel") == 0)
+    {
+        putsUart0("Canceling...\n");
+        return;
+    }
+
+    putsUart0("Dispensing Please Wait...\n");
+    StartDispenseSteps(position, (uint32_t) rotations * AUGERUSTEPREV);
+    DispenseFlush();
+
+    putsUart0("Enter the amount dispensed in half-teaspoons (or cancel to return): ");
+    getUserInput(data);
+
+    if (strcmp(getFieldString(data, 0), "cancel") == 0)
+    {
+        putsUart0("Canceling...\n");
+        return;
+    }
+
+    strcpy(str, getFieldString(data, 0));
+    measured = (uint16_t)getFieldInteger(data, 0);
+
+    if (!isDigitString(str) || measured == 0)
+    {
+        putsUart0("====================== ERROR ======================\n");
+        putsUart0("The amount must be at least one half-teaspoon. Try again\n");
+        putsUart0("with more rotations if less was dispensed\n");
+        return;
+    }
+
+    // Every dose adds the auger offset, the test dose included, so
+    // it is left out here (See StartAugerPos). Round to the nearest
+    // microstep
+    microsteps = ((uint32_t) rotations * AUGERUSTEPREV + (measured >> 1)) / measured;
+    DOSE_USTEPS[position] = (uint16_t) microsteps;
+    error = Write_DoseCalib(position, (uint16_t) microsteps);
+
+    // The test dispense came out of the slot
+    rem_amount = Read_SpiceRemQty(position);
+    rem_amount = (rem_amount > measured) ? rem_amount - measured : 0;
+    error |= Write_SpiceRemQty(position, rem_amount);
+    error |= Flush_SpiceRemQty();
+
+    if (error)
+    {
+        putsUart0("====================== WARNING ======================\n");
+        putsUart0("There was an issue saving the calibration to the EEPROM\n");
+        putsUart0("You may try again or reset the system\n");
+    }
+    else
+    {
+        putsUart0("New calibration is ");
+        strcpy(str, rusty_itoa(DOSE_USTEPS[position]));
+        putsUart0(str);
+        putsUart0(" microsteps per half-teaspoon\n");
+    }
+
+    putsUart0("Command completed\n");
+}
+
+void initRackTune(void)
+{
+    uint16_t speed = 0;
+    uint16_t accel = 0;
+
+    // A tune slower than the defaults is ignored
+    if ((Read_RackTune(&speed, &accel) == 0) && (speed >= RACKTUNEDEFSPD) && (accel >= RACKACCELQ16))
+    {
+        SetRackTune(speed, accel);
+    }
+}
+
+void autoTune(USER_DATA* data)
+{
+    uint16_t speed = 0;
+    uint16_t good_speed = 0;
+    uint32_t accel = 0;
+    uint32_t good_accel = 0;
+    uint32_t maxerror = 0;
+    uint16_t error = 0;
+    char str[MAX_CHARS];
+
+    putsUart0("====================== NOTICE ======================\n");
+    putsUart0("The rack will be turned at increasing speeds until it\n");
+    putsUart0("loses steps. Please keep clear of the rack.\n");
+    putsUart0("Press any key to continue or type cancel to return: ");
+    getUserInput(data);
+
+    if (strcmp(getFieldString(data, 0), "cancel") == 0)
+    {
+        putsUart0("Canceling...\n");
+        return;
+    }
+
+    // Find the highest cruise speed at the default acceleration
+    RackTuneReference();
+
+    for (speed = RACKTUNESTARTSPD; speed <= RACKTUNEMAXSPD; speed += RACKTUNESPDSTEP)
+    {
+        maxerror = RackTuneTrial(speed, RACKACCELQ16);
+        sprintf(str, "Speed %u RPM: error %lu microsteps\n", speed, (unsigned long) maxerror);
+        putsUart0(str);
+
+        if (maxerror > RACKTUNEMAXERR)
+        {
+            break;
+        }
+
+        good_speed = speed;
+    }
+
+    if (good_speed == 0)
+    {
+        putsUart0("====================== ERROR ======================\n");
+        putsUart0("The rack lost steps at the lowest speed. Check the rack\n");
+        putsUart0("for obstructions. The current limits are kept.\n");
+        UIRackHome();
+        return;
+    }
+
+    // The position can't be trusted after losing steps
+    if (maxerror > RACKTUNEMAXERR)
+    {
+        if (UIRackHome() != 0)
+        {
+            putsUart0("The current limits are kept.\n");
+            return;
+        }
+
+        RackTuneReference();
+    }
+
+    // Find the highest acceleration at the tuned speed
+    maxerror = 0;
+    good_accel = RACKACCELQ16;
+
+    for (accel = RACKACCELQ16 + RACKTUNEACCELSTEP; accel <= RACKTUNEMAXACCEL; accel += RACKTUNEACCELSTEP)
+    {
+        maxerror = RackTuneTrial(good_speed, accel);
+        sprintf(str, "Accel %lu: error %lu microsteps\n", (unsigned long) accel, (unsigned long) maxerror);
+        putsUart0(str);
+
+        if (maxerror > RACKTUNEMAXERR)
+        {
+            break;
+        }
+
+        good_accel = accel;
+    }
+
+    // The position can't be trusted after losing steps. The limits
+    // are only saved once the rack is homed again
+    if ((maxerror > RACKTUNEMAXERR) && (UIRackHome() != 0))
+    {
+        putsUart0("The current limits are kept.\n");
+        return;
+    }
+
+    // Back off from the limits by the safety margin but never run
+    // slower than the defaults
+    good_speed = (good_speed * RACKTUNEMARGIN) / 100;
+    good_accel = (good_accel * RACKTUNEMARGIN) / 100;
+    good_speed = (good_speed < RACKTUNEDEFSPD) ? RACKTUNEDEFSPD : good_speed;
+    good_accel = (good_accel < RACKACCELQ16) ? RACKACCELQ16 : good_accel;
+
+    SetRackTune(good_speed, good_accel);
+    error = Write_RackTune(good_speed, (uint16_t) good_accel);
+
+    sprintf(str, "Rack tuned to %u RPM, accel %lu\n", good_speed, (unsigned long) good_accel);
+    putsUart0(str);
+
+    if (error)
+    {
+        putsUart0("====================== WARNING ======================\n");
+        putsUart0("There was an issue saving the limits to the EEPROM\n");
+        putsUart0("You may try again or reset the system\n");
+    }
+
+    putsUart0("Command completed\n");
+}
+
+void initSlotGeometry(void)
+{
+    uint8_t i = 0;
+
+    SetRackSlots(Read_NumofSlots());
+
+    for (i = 0; i < RACK_SLOTS; i++)
+    {
+        SetSlotAngle(i, Read_SlotAngle(i));
+    }
+}
+
+void slotGeometry(USER_DATA* data)
+{
+    //slots [<count>] or slots <slot> <angle>
+    uint8_t i = 0;
+    uint16_t slot = 0;
+    uint16_t angle = 0;
+    uint16_t microsteps = 0;
+    uint16_t error = 0;
+    char str[MAX_CHARS];
+
+    if (data->fieldCount == 2)
+    {
+        // Change the number of slots. The angles go back to the even spacing
+        slot = (uint16_t)getFieldInteger(data, 1);
 
+        if (!isDigitString(getFieldString(data, 1)) || slot < 2 || slot > MAXSLOTS)
+        {
+            putsUart0("====================== ERROR ======================\n");
+            putsUart0("The number of slots must be between 2 and ");
+            strcpy(str, rusty_itoa(MAXSLOTS));
+            putsUart0(str);
+            putsUart0("\n");
+            return;
+        }
+
+        error = Write_NumofSlots((uint8_t) slot);
+
+        for (i = 0; i < MAXSLOTS; i++)
+        {
+            error |= Write_SlotAngle(i, SLOTANGLENONE);
+        }
+
+        SetRackSlots((uint8_t) slot);
+
+        putsUart0("====================== NOTICE ======================\n");
+        putsUart0("The slots are now evenly spaced. Spices in removed slots\n");
+        putsUart0("can't be dispensed until the slots are added back.\n");
+    }
+    else if (data->fieldCount >= 3)
+    {
+        // Correct the angle (tenths of a degree CW from home) of one slot
+        slot = (uint16_t)getFieldInteger(data, 1);
+        angle = (uint16_t)getFieldInteger(data, 2);
+
+        if (!isDigitString(getFieldString(data, 1)) || slot >= RACK_SLOTS ||
+            !isDigitString(getFieldString(data, 2)) || angle >= SLOTANGLETENTHS)
+        {
+            putsUart0("====================== ERROR ======================\n");
+            putsUart0("The slot must be between 0 and ");
+            strcpy(str, rusty_itoa(RACK_SLOTS - 1));
+            putsUart0(str);
+            putsUart0(" and the angle between 0 and ");
+            strcpy(str, rusty_itoa(SLOTANGLETENTHS - 1));
+            putsUart0(str);
+            putsUart0(" tenths of a degree\n");
+            return;
+        }
+
+        // Round to the nearest rack microstep
+        microsteps = (uint16_t) ((((uint32_t) angle * RACKUSTEPREV) + (SLOTANGLETENTHS / 2)) / SLOTANGLETENTHS);
+        SetSlotAngle((uint8_t) slot, microsteps);
+        error = Write_SlotAngle((uint8_t) slot, SLOT_USTEPS[slot]);
+
+        // Show the new position so the alignment can be checked
+        if (IsRackPositionValid())
+        {
+            putsUart0("Moving the rack to the slot...\n");
+            SetRackPos(slot);
+        }
+    }
+
+    if (error)
+    {
+        putsUart0("====================== WARNING ======================\n");
+        putsUart0("There was an issue saving the slots to the EEPROM\n");
+        putsUart0("You may try again or reset the system\n");
+    }
+
+    strcpy(str, rusty_itoa(RACK_SLOTS));
+    putsUart0(str);
+    putsUart0(" slots (angles in tenths of a degree):\n");
+
+    for (i = 0; i < RACK_SLOTS; i++)
+    {
+        angle = (uint16_t) ((((uint32_t) SLOT_USTEPS[i] * SLOTANGLETENTHS) + (RACKUSTEPREV / 2)) / RACKUSTEPREV);
+        sprintf(str, "%u: %u\t%s\n", i, angle, SpiceList[i]);
+        putsUart0(str);
+    }
+
+    putsUart0("Command completed\n");
+}
+
+void initServoSlew(void)
+{
+    uint16_t slew = 0;
+
+    if (Read_ServoSlew(&slew) == 0 && slew >= SERVOMINSLEW && slew <= SERVOMAXSLEW)
+    {
+        SERVO_SLEW_US = slew;
+    }
+}
+
+void servoSlew(USER_DATA* data)
+{
+    //servo [<slew>]
+    uint16_t slew = 0;
+    uint16_t error = 0;
+    char str[MAX_CHARS];
+
+    // Only display the slew rate if no new value was given
+    if (data->fieldCount >= 2)
+    {
+        slew = (uint16_t)getFieldInteger(data, 1);
+
+        if (!isDigitString(getFieldString(data, 1)) || slew < SERVOMINSLEW || slew > SERVOMAXSLEW)
+        {
+            sprintf(str, "The slew rate must be between %u and %u us per degree\n", SERVOMINSLEW, SERVOMAXSLEW);
+            putsUart0("====================== ERROR ======================\n");
+            putsUart0(str);
+            return;
+        }
+
+        SERVO_SLEW_US = slew;
+        error = Write_ServoSlew(slew);
+
+        if (error)
+        {
+            putsUart0("====================== WARNING ======================\n");
+            putsUart0("There was an issue saving the slew rate to the EEPROM\n");
+            putsUart0("You may try again or reset the system\n");
+        }
+    }
+
+    sprintf(str, "Servo slew rate: %u us per degree\n", SERVO_SLEW_US);
+    putsUart0(str);
+    sprintf(str, "Clutch engage/release time: %lu ms\n", (unsigned long) (ServoMoveUS(SVO_DIS_POS, SVO_ENG_POS) / 1000));
+    putsUart0(str);
+    putsUart0("Command completed\n");
+}
+
+void motionStats(USER_DATA* data)
+{
+    //motionstats [clear]
+#if MOTIONSTATS
+    static const char* const MotorNames[NUMMOTORS] = {"Rack", "Auger"};
+    MotionStatsStructType stats;
+    uint32_t motorID = 0;
+    uint8_t i = 0;
+    char str[MAX_CHARS];
+
+    if (data->fieldCount >= 2)
+    {
+        if (strcmp(getFieldString(data, 1), "clear") != 0)
+        {
+            putsUart0("====================== ERROR ======================\n");
+            putsUart0("Use motionstats clear to clear the step timing\n");
+            return;
+        }
+
+        ClearMotionStats();
+        putsUart0("Step timing cleared\n");
+        putsUart0("Command completed\n");
+        return;
+    }
+
+    for (motorID = 0; motorID < NUMMOTORS; motorID++)
+    {
+        stats = GetMotionStats(motorID);
+
+        sprintf(str, "%s Motor: %lu steps timed, %lu early, %lu late, %lu overruns\n", MotorNames[motorID],
+                (unsigned long) stats.samples, (unsigned long) stats.early, (unsigned long) stats.late, (unsigned long) stats.overruns);
+        putsUart0(str);
+
+        if (stats.samples == 0)
+        {
+            continue;
+        }
+
+        sprintf(str, "Max latency %lu ns, period error %ld to %ld ns\n",
+                (unsigned long) (stats.maxlatency * 1000 / TICKSPERUS),
+                (long) (stats.minerror * 1000 / (int32_t) TICKSPERUS), (long) (stats.maxerror * 1000 / (int32_t) TICKSPERUS));
+        putsUart0(str);
+        putsUart0("  Ticks          Latency      |Error|\n");
+
+        // Only the bins holding samples are listed
+        for (i = 0; i < MSTATBINS; i++)
+        {
+            if (stats.latency[i] == 0 && stats.error[i] == 0)
+            {
+                continue;
+            }
+
+            if (i == 0)
+            {
+                sprintf(str, "  0            ");
+            }
+            else if (i == (MSTATBINS - 1))
+            {
+                sprintf(str, "  %-5lu+       ", (unsigned long) (1UL << (i - 1)));
+            }
+            else
+            {
+                sprintf(str, "  %-5lu-%-5lu  ", (unsigned long) (1UL << (i - 1)), (unsigned long) ((1UL << i) - 1));
+            }
+            putsUart0(str);
+
+            sprintf(str, "%10lu   %10lu\n", (unsigned long) stats.latency[i], (unsigned long) stats.error[i]);
+            putsUart0(str);
+        }
+    }
+
+    sprintf(str, "1 tick = %lu ns\n", (unsigned long) (1000 / TICKSPERUS));
+    putsUart0(str);
+    putsUart0("Command completed\n");
+#else
+    (void) data;
+
+    putsUart0("====================== WARNING ======================\n");
+    putsUart0("Step timing is not built in. Rebuild with MOTIONSTATS\n");
+    putsUart0("set to 1 to use this command\n");
+#endif
 }
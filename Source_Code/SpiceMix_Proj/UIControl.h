@@ -20,6 +20,8 @@
  *========================================================
  */
 #define ERRORMATCH 255
+#define CALIBMAXROT 20 // Max auger rotations of a calibration dispense
+#define MAXDOSEITEMS (MAXSLOTS * 2) // Max doses of a recipe once split over the slots
 
 /*========================================================
 * Variable Declarations
@@ -54,6 +56,55 @@ char* rusty_itoa(uint16_t num);
  */
 extern void getUserInput(USER_DATA* data);
 
+/*=======================================================
+ * Function Name: slotSearch
+ *=======================================================
+ * Parameters: data, field
+ * Return: position
+ * Description:
+ * Helper function to find the slot given in a field of
+ * the UART buffer. The field may either be a slot number
+ * or a spice name, in which case the first slot holding
+ * the spice is returned. ERRORMATCH is returned if no
+ * slot matches.
+ *=======================================================
+ */
+extern uint8_t slotSearch(USER_DATA* data, uint8_t field);
+
+/*=======================================================
+ * Function Name: spiceRemQty
+ *=======================================================
+ * Parameters: spice, remaining
+ * Return: quantity
+ * Description:
+ * Helper function to add up the remaining quantity of a
+ * spice over all the slots holding it. Spice is any slot
+ * holding the spice and remaining is the remaining
+ * quantity of each slot.
+ *=======================================================
+ */
+extern uint16_t spiceRemQty(uint8_t spice, uint16_t remaining[]);
+
+/*=======================================================
+ * Function Name: planSpiceDose
+ *=======================================================
+ * Parameters: spice, quantity, rack, remaining, plan, size
+ * Return: count
+ * Description:
+ * Helper function to choose the slots a dose of a spice
+ * is dispensed from. The slot nearest the rack position
+ * (microsteps) that holds the whole dose is used. If no
+ * slot holds enough, the dose is split and each part is
+ * taken from the nearest slot with spice left. Once all
+ * slots are empty the rest of the dose is taken from the
+ * nearest slot. The doses (slot and quantity) are written
+ * to plan (at most size) and their number is returned.
+ * Rack and remaining are updated to the values after the
+ * doses, so a recipe can be planned one spice at a time.
+ *=======================================================
+ */
+extern uint8_t planSpiceDose(uint8_t spice, uint16_t quantity, int32_t* rack, uint16_t remaining[], SpiceDataType plan[], uint8_t size);
+
 /*=======================================================
  * Function Name: dispenseSpice
  *=======================================================
@@ -65,11 +116,13 @@ extern void getUserInput(USER_DATA* data);
  * validate the requested spice against the list of known
  * stored spices. If no existing spice is found, the
  * user is notified and the action is aborted. The function
- * will also validate that the spice has enough to dispense
- * the requested quantity. If an insufficient amount
- * is detected, the action is aborted. If all checks are
- * validated, the Dispense sequence is executed and
- * the spice quantity is updated in the EEPROM.
+ * will also validate that the slots holding the spice
+ * have enough to dispense the requested quantity. If an
+ * insufficient amount is detected, the user may abort the
+ * action. The dose is taken from the nearest slot holding
+ * enough of the spice, or split over several slots (See
+ * planSpiceDose). The Dispense sequence is executed and
+ * the spice quantity of each slot is updated in the EEPROM.
  *=======================================================
  */
 extern void dispenseSpice(USER_DATA* data);
@@ -86,10 +139,15 @@ extern void dispenseSpice(USER_DATA* data);
  * stored recipes. If no existing recipe is found, the
  * user is notified and the action is aborted. The function
  * will also validate that there is enough of each spice
- * to dispense. If an insufficient amount
- * is detected, the action is aborted. If all checks are
- * validated, the Dispense sequence is executed and
- * the spice quantity is updated in the EEPROM.
+ * to dispense. If an insufficient amount is detected, the
+ * user may abort the action. Unless "asis" is given, the
+ * spices are put in the order with the least rack travel
+ * from the current rack position (See PlanDoseOrder). Each
+ * spice is then taken from the slots nearest to where the
+ * rack will be after the previous spice (See planSpiceDose)
+ * and the resulting doses are ordered again. The Dispense sequence
+ * is executed and the spice quantities are updated in the
+ * EEPROM.
  *=======================================================
  */
 extern void dispenseRecipe(USER_DATA* data);
@@ -127,13 +185,30 @@ extern void printRecipe(USER_DATA* data);
  * spice entry, the entry is checked that it exists in the known spice list
  * and that a valid quantity was provided. If the user enters a spice
  * twice, the most recent entry will take precedence. Once all entries
- * have been entered the recipe is saved (or updated) in the EEPROM.
+ * have been entered the user may choose to sort the spices in the
+ * order with the least rack travel from home (See PlanDoseOrder).
+ * The recipe is then saved (or updated) in the EEPROM.
  * In the event there is an issue writing to the EEPROM, the user is
  * notified.
  *====================================================================
  */
 extern void saveRecipe(USER_DATA* data);
 
+/*====================================================================
+ * Function Name: initEepromData
+ *====================================================================
+ * Parameters: None
+ * Return: None
+ * Description:
+ * Function will initialize the spice data in the EEPROM. The user is
+ * told before an EEPROM in the old 8 slot layout is moved to the new
+ * layout, and warned before an EEPROM in a layout that is not
+ * recognized is reset to the defaults. Any recipes of an earlier
+ * layout that no longer fit are listed.
+ *====================================================================
+ */
+extern void initEepromData(void);
+
 /*====================================================================
  * Function Name: initSpiceList
  *====================================================================
@@ -166,14 +241,15 @@ extern void initRecipeList(void);
  * Function Name: UIRackHome
  *====================================================================
  * Parameters: None
- * Return: None
+ * Return: error
  * Description:
  * Function for performing the actions of the UI command "home". 
  * Function will perform a call to the StepRackHome motor control
  * function and will notify the user if there was an error in homing.
+ * The error from StepRackHome is returned.
  *====================================================================
  */
-extern void UIRackHome(void);
+extern uint16_t UIRackHome(void);
 
 /*====================================================================
  * Function Name: refillSpice
@@ -182,9 +258,10 @@ extern void UIRackHome(void);
  * Return: None
  * Description:
  * Function will update the stored quantity of a given spice. 
- * The function first validates that the given spice name exists. 
- * If no existing spice is found, the user is notified and the 
- * action is aborted. The function will also validate that the entered
+ * The function first validates that the given spice name or slot
+ * number exists. If no existing spice is found, the user is notified
+ * and the action is aborted. A spice held in several slots refills
+ * the slot with the least remaining. The function will also validate that the entered
  * quantity is less than the max allowed quantity. If the entered amount
  * is greater than allowed the function will notify the user. However,
  * the action will not be aborted. Instead, it will assume that the spice
@@ -309,8 +386,156 @@ extern void displaySpices(void);
  */
 extern void displayRecipes(void);
 
+/*====================================================================
+ * Function Name: initDoseCalib
+ *====================================================================
+ * Parameters: None
+ * Return: None
+ * Description:
+ * Function will read the EEPROM and initialize the dose calibration
+ * table used by the motor control to convert half-teaspoons into
+ * auger microsteps, as well as the auger speed and ramp rate of
+ * each slot.
+ *====================================================================
+ */
+extern void initDoseCalib(void);
+
+/*====================================================================
+ * Function Name: augerProfile
+ *====================================================================
+ * Parameters: data
+ * Return: None
+ * Description:
+ * Function performs the actions of the "auger" command. The function
+ * validates the given spice name and displays the auger speed (RPM)
+ * and ramp rate (RPM per auger rotation) used to dispense it. If a
+ * new speed and ramp rate are given they are validated against the
+ * limits of the auger motor and saved in the EEPROM first. If only a
+ * speed is given the current ramp rate is kept.
+ *====================================================================
+ */
+extern void augerProfile(USER_DATA* data);
+
+/*====================================================================
+ * Function Name: initRackTune
+ *====================================================================
+ * Parameters: None
+ * Return: None
+ * Description:
+ * Function will read the EEPROM and apply the rack speed and
+ * acceleration found by the auto-tune command. If the rack has never
+ * been tuned the defaults are kept.
+ *====================================================================
+ */
+extern void initRackTune(void);
+
+/*====================================================================
+ * Function Name: autoTune
+ *====================================================================
+ * Parameters: data
+ * Return: None
+ * Description:
+ * Function performs the actions of the "tune" command. After the user
+ * confirms, the hall sensor edges are learnt at a slow speed and the
+ * rack is then turned back and forth at increasing cruise speeds
+ * until the hall sensors show the rack has lost steps. The
+ * acceleration is then stepped up in the same way at the highest
+ * speed that passed. Both limits are reduced by a safety margin,
+ * applied to the rack slot moves and saved in the EEPROM. The rack is
+ * homed again whenever a trial has lost steps.
+ *====================================================================
+ */
+extern void autoTune(USER_DATA* data);
+
+/*====================================================================
+ * Function Name: calibrate
+ *====================================================================
+ * Parameters: data
+ * Return: None
+ * Description:
+ * Function performs the actions of the "calibrate" command. The
+ * function validates the given spice name and number of auger
+ * rotations, then dispenses the rotations from the slot of the spice
+ * into a measuring spoon. The user is prompted to enter the measured
+ * amount in half-teaspoons, from which the number of auger microsteps
+ * per half-teaspoon of the spice is calculated and saved in the
+ * EEPROM. The measured amount is also removed from the remaining
+ * quantity of the spice.
+ *====================================================================
+ */
 extern void calibrate(USER_DATA* data);
 
+/*====================================================================
+ * Function Name: initSlotGeometry
+ *====================================================================
+ * Parameters: None
+ * Return: None
+ * Description:
+ * Function will read the EEPROM and initialize the number of carousel
+ * slots and the calibrated angle of each slot. Slots that have not
+ * been calibrated are evenly spaced.
+ *====================================================================
+ */
+extern void initSlotGeometry(void);
+
+/*====================================================================
+ * Function Name: slotGeometry
+ *====================================================================
+ * Parameters: data
+ * Return: None
+ * Description:
+ * Function performs the actions of the "slots" command. With one
+ * argument the number of carousel slots is changed and all slots are
+ * returned to the even spacing. With two arguments the angle of a
+ * slot (tenths of a degree CW from home) is corrected, and the rack is
+ * moved to the slot if its position is known so the alignment can be
+ * checked. The changes are saved in the EEPROM and the angle of each
+ * slot is then displayed.
+ *====================================================================
+ */
+extern void slotGeometry(USER_DATA* data);
+
+/*====================================================================
+ * Function Name: initServoSlew
+ *====================================================================
+ * Parameters: None
+ * Return: None
+ * Description:
+ * Function will read the EEPROM and apply the calibrated servo slew
+ * rate used to time the clutch moves. If it has never been
+ * calibrated the default is kept.
+ *====================================================================
+ */
+extern void initServoSlew(void);
+
+/*====================================================================
+ * Function Name: servoSlew
+ *====================================================================
+ * Parameters: data
+ * Return: None
+ * Description:
+ * Function performs the actions of the "servo" command. If a new
+ * slew rate (microseconds per degree) is given it is validated,
+ * applied and saved in the EEPROM. The slew rate and the resulting
+ * time allowed for a clutch move are then displayed.
+ *====================================================================
+ */
+extern void servoSlew(USER_DATA* data);
+
+/*====================================================================
+ * Function Name: motionStats
+ *====================================================================
+ * Parameters: data
+ * Return: None
+ * Description:
+ * Function performs the actions of the "motionstats" command. The
+ * step interrupt latency and step period error histograms of each
+ * motor are displayed, or cleared if "clear" is given. The timing is
+ * only collected when the system is built with MOTIONSTATS set to 1.
+ *====================================================================
+ */
+extern void motionStats(USER_DATA* data);
+
 
 
 #endif /* UICONTROL_H_ */
@@ -10,6 +10,7 @@
  */
 
 
+#include <string.h>
 #include "eepromControl.h"
 #include "eeprom.h"
 
@@ -21,16 +22,45 @@
 // Default Spices
 SpiceStructType DefaultSpices[MAXSLOTS] =
 {
-	{"SALT", 0x600},
-	{"BLACKPEPPER", 0x601},
-	{"GARLIC", 0x602},
-	{"PAPRIKA", 0x603},
-	{"ONION", 0x604},
-	{"OREGANO", 0x605},
-	{"THYME", 0x606},
-	{"ROSEMARY", 0x607},
+	{"SALT", {0x600}},
+	{"BLACKPEPPER", {0x601}},
+	{"GARLIC", {0x602}},
+	{"PAPRIKA", {0x603}},
+	{"ONION", {0x604}},
+	{"OREGANO", {0x605}},
+	{"THYME", {0x606}},
+	{"ROSEMARY", {0x607}},
+	{"CUMIN", {0x608}},
+	{"CHILI", {0x609}},
+	{"CINNAMON", {0x60A}},
+	{"BASIL", {0x60B}},
+	{"PARSLEY", {0x60C}},
+	{"GINGER", {0x60D}},
+	{"NUTMEG", {0x60E}},
+	{"TURMERIC", {0x60F}},
 };
 
+// RAM copy of the spice data words (two slots per word).
+// Each set bit of SpiceQtyDirty is a slot not yet journaled.
+static EEPROMDataBlockType SpiceQty[MAXSLOTS / 2];
+static uint32_t SpiceQtyDirty = 0;
+
+// Quantity journal state. Head is the next record written and
+// count the records written since the last compaction.
+static uint16_t JrnlHead = 0;
+static uint16_t JrnlCount = 0;
+static uint8_t JrnlSeq = 0;
+
+// RAM copy of the recipe directory and a bitmap of the recipe
+// blocks in use (MAXNUMRECP must fit in 32 bits). See Load_RecipeDir
+static uint8_t RecipeDir[MAXNUMRECP];
+static uint32_t RecipeBlkUsed = 0;
+
+// Names of the recipes of an earlier layout that no longer fit.
+// See Save_DroppedRecipes
+static uint8_t DroppedRecipes[MAXDROPRECP][MAXNAMESIZE];
+static uint8_t NumDroppedRecipes = 0;
+
 /*========================================================
  * Function Declarations
  *========================================================
@@ -39,6 +69,16 @@ SpiceStructType DefaultSpices[MAXSLOTS] =
 //Forward Declaration since we don't this to be used outside of this library
 uint16_t Write_NameEEProm(uint16_t offset, uint8_t* name);
 uint8_t* Read_NameEEProm(uint16_t offset);
+bool Update_SpiceQtyCache(uint8_t position, uint16_t qty);
+bool Check_JournalRecord(uint32_t record);
+uint16_t Compact_SpiceJournal(void);
+uint16_t Replay_SpiceJournal(void);
+uint16_t Erase_SpiceJournal(void);
+uint16_t Recipe_BlockAddr(uint8_t number);
+uint16_t Write_RecipeDir(uint8_t from, uint8_t to);
+uint16_t Load_RecipeDir(void);
+uint16_t Migrate_SpiceData(void);
+void Save_DroppedRecipes(void);
 
 /*=======================================================
  * Function Name: Read_NameEEProm
@@ -98,18 +138,16 @@ uint8_t* Read_NameEEProm(uint16_t offset)
  */
 uint8_t* Read_RecipeName(uint8_t number)
 {
-    uint16_t offset = 0;
     uint8_t num_of_stored_rec = Read_NumofRecipes();
-    offset = (number * RECBLKSIZE) + RECBLKADDR;
 
     // Validate the provided position
-    if (number > num_of_stored_rec)
+    if (number >= num_of_stored_rec)
     {
         return (uint8_t *) ERRORINVALID;
     }
 
     // Return pointer to the string
-    return Read_NameEEProm(offset);
+    return Read_NameEEProm(Recipe_BlockAddr(number));
 }
 
 /*=======================================================
@@ -133,10 +171,13 @@ RecipeStructType Read_Recipe(uint8_t number)
 	uint8_t temp[4];
 	bool endofstr = false;
 	 
-	offset = (number * RECBLKSIZE) + RECBLKADDR;
+	// An empty recipe is returned for an unused recipe number
+	if (number >= MAXNUMRECP || RecipeDir[number] == RECDIRNONE)
+	{
+		return recipe;
+	}
 
-	//TBD Add some validation for given number.
-	// Not sure how to indicate bad number since function returns a struct
+	offset = Recipe_BlockAddr(number);
 
 	for (indx = 0; (indx < MAXNAMESIZE) && (endofstr == false); indx = indx + 4)
 	{
@@ -160,7 +201,7 @@ RecipeStructType Read_Recipe(uint8_t number)
 	}
 
 	// Reset Offset to Recipe Data Position
-	offset = (number * RECBLKSIZE) + RECBLKADDR + 0x04;
+	offset = Recipe_BlockAddr(number) + 0x04;
 
 	// Extract the recipe data 2 positions at a time
 	for (indx = 0; indx < MAXSLOTS; indx=indx+2)
@@ -188,18 +229,15 @@ RecipeStructType Read_Recipe(uint8_t number)
  * Return: quantity or error
  * Description:
  * This function is used to read the remaining quantity
- * of a given spice position. If an invalid position
- * was provided, an "Invalid" Error code is returned.
+ * of a given spice position from the RAM copy of the
+ * spice data, so it does not wait on the EEPROM. If an
+ * invalid position was provided, an "Invalid" Error code
+ * is returned.
  *=======================================================
  */
 uint16_t Read_SpiceRemQty(uint8_t position)
 {
-	EEPROMDataBlockType data;
 	SpiceDataType spicedata;
-	// Divide Position by 2 to determine Word Offset
-	uint16_t offset = position >> 1;
-
-	data.FullWord = readEeprom(SPICEDATADDR + offset);
 
 	// Validate the position is within range
 	if (position > MAXSLOTS - 1)
@@ -208,13 +246,14 @@ uint16_t Read_SpiceRemQty(uint8_t position)
 	}
 
 	// Determine the 16-bit offset and return the appropriate word
+	// Divide Position by 2 to determine Word Offset
 	if ((position & 0x01) == 0)
 	{
-		spicedata.As16BitWord = data.HalfWord.Lower16Bits;
+		spicedata.As16BitWord = SpiceQty[position >> 1].HalfWord.Lower16Bits;
 	}
 	else
 	{
-		spicedata.As16BitWord = data.HalfWord.Upper16Bits;
+		spicedata.As16BitWord = SpiceQty[position >> 1].HalfWord.Upper16Bits;
 	}
 
 	return spicedata.DataBits.quantity;
@@ -331,39 +370,59 @@ uint16_t Write_NameEEProm(uint16_t offset, uint8_t* name)
  * Return: error
  * Description:
  * This function is used to write or update the remaining
- * quantity of a spice at the given position. If an
- * invalid position is given, an "Invalid" error code
- * will be returned. In the event of some EEPROM write 
- * error, an EEPROM error code will be returned.
+ * quantity of a spice at the given position. Only the RAM
+ * copy is updated, the EEPROM is written through the
+ * quantity journal by Flush_SpiceRemQty. If an invalid
+ * position is given, an
+ * "Invalid" error code will be returned.
  *=======================================================
  */
 uint16_t Write_SpiceRemQty(uint8_t position, uint16_t qty)
 {
-	EEPROMDataBlockType eeprom_data;
-	SpiceDataType spice_data;
-	uint16_t error = 0;
-
 	// Limit the max quantity
 	if (qty > MAXQTY)
 	{
 		qty = MAXQTY;
 	}
 
+	if (position > MAXSLOTS - 1)
+	{
+		return ERRORINVALID;
+	}
+
+	// Only a changed quantity needs to be written back
+	if (Update_SpiceQtyCache(position, qty))
+	{
+		SpiceQtyDirty |= 1UL << position;
+	}
+
+	return 0;
+}
+
+/*=======================================================
+ * Function Name: Update_SpiceQtyCache
+ *=======================================================
+ * Parameters: position, qty
+ * Return: changed
+ * Description:
+ * This helper function updates the quantity of a spice
+ * position in the RAM copy of the spice data words. True
+ * is returned if the quantity was changed.
+ *=======================================================
+ */
+bool Update_SpiceQtyCache(uint8_t position, uint16_t qty)
+{
+	EEPROMDataBlockType eeprom_data;
+	SpiceDataType spice_data;
 	// Divide Position by 2 to determine Word Offset
 	uint16_t offset = position >> 1;
 
 	spice_data.DataBits.position = position;
 	spice_data.DataBits.quantity = qty;
 
-	// Make a copy of the current 32-bit word in the EEPROM,
-	// since spice data is only 16 bits and we do not want to overwrite
-	// the other data.
-	eeprom_data.FullWord = readEeprom(SPICEDATADDR + offset);
-
-	if (position > MAXSLOTS - 1)
-	{
-		return ERRORINVALID;
-	}
+	// Update a copy of the 32-bit word, since spice data is
+	// only 16 bits and we do not want to overwrite the other data.
+	eeprom_data = SpiceQty[offset];
 
 	// Determine the 16-bit offset and write to the appropriate word
 	if ((position & 0x01) == 0)
@@ -375,10 +434,229 @@ uint16_t Write_SpiceRemQty(uint8_t position, uint16_t qty)
 		eeprom_data.HalfWord.Upper16Bits = spice_data.As16BitWord;
 	}
 
-	// Write the Data to the EEPROM. (NOTE THIS IS A BLOCKING FUNCTION)
-	error = writeEeprom(SPICEDATADDR + offset, eeprom_data.FullWord);
+	if (eeprom_data.FullWord == SpiceQty[offset].FullWord)
+	{
+		return false;
+	}
+
+	SpiceQty[offset] = eeprom_data;
+	return true;
+}
+
+/*=======================================================
+ * Function Name: Check_JournalRecord
+ *=======================================================
+ * Parameters: record
+ * Return: valid
+ * Description:
+ * This helper function validates a quantity journal
+ * record. The check byte is the sum of the other three
+ * bytes mixed with a key, so erased or torn words are
+ * rejected along with out of range quantities.
+ *=======================================================
+ */
+bool Check_JournalRecord(uint32_t record)
+{
+	return (record & 0xFF) == JRNLCHECK(record) && ((record >> JRNLQTY_S) & 0xFFF) <= MAXQTY;
+}
+
+/*=======================================================
+ * Function Name: Compact_SpiceJournal
+ *=======================================================
+ * Parameters: None
+ * Return: error
+ * Description:
+ * This helper function folds the quantity journal into the
+ * spice data words by writing back every word that differs
+ * from the RAM copy. The journal records can then be
+ * overwritten. It must run before the journal ring wraps
+ * onto a record written since the last compaction.
+ * (NOTE THIS IS A BLOCKING FUNCTION)
+ *=======================================================
+ */
+uint16_t Compact_SpiceJournal(void)
+{
+	uint16_t offset = 0;
+	uint16_t error = 0;
+
+	for (offset = 0; offset < MAXSLOTS / 2; offset++)
+	{
+		if (readEeprom(SPICEDATADDR + offset) != SpiceQty[offset].FullWord)
+		{
+			error = writeEeprom(SPICEDATADDR + offset, SpiceQty[offset].FullWord);
+			if (error != 0)
+			{
+				return error;
+			}
+		}
+	}
+
+	JrnlCount = 0;
+	return error;
+}
+
+/*=======================================================
+ * Function Name: Flush_SpiceRemQty
+ *=======================================================
+ * Parameters: None
+ * Return: error
+ * Description:
+ * This function appends the quantities changed by
+ * Write_SpiceRemQty to the quantity journal, one record
+ * per slot no matter how many times it changed. The
+ * journal is a ring over JRNLBLOCKS EEPROM blocks, so the
+ * wear is spread across them instead of the spice data
+ * words, which are only written when the journal is
+ * compacted (about once per JRNLSIZE records).
+ * A flush may compact the journal, so it is only called
+ * when the motors are idle, never from a dispense wait
+ * loop. A quantity that fails to write is kept
+ * for the next flush and the EEPROM error code is returned.
+ * (NOTE THIS IS A BLOCKING FUNCTION)
+ *=======================================================
+ */
+uint16_t Flush_SpiceRemQty(void)
+{
+	uint32_t record = 0;
+	uint8_t position = 0;
+	uint16_t error = 0;
+
+	if (SpiceQtyDirty == 0)
+	{
+		return 0;
+	}
+
+	for (position = 0; position < MAXSLOTS; position++)
+	{
+		if (SpiceQtyDirty & (1UL << position))
+		{
+			// Every record in the ring is newer than the spice data words
+			if (JrnlCount >= JRNLSIZE)
+			{
+				error = Compact_SpiceJournal();
+				if (error != 0)
+				{
+					break;
+				}
+			}
+
+			record = ((uint32_t) JrnlSeq << JRNLSEQ_S) | ((uint32_t) position << JRNLSLOT_S) |
+			         ((uint32_t) Read_SpiceRemQty(position) << JRNLQTY_S);
+			record |= JRNLCHECK(record);
+
+			error = writeEeprom(JRNLADDR + JrnlHead, record);
+			if (error != 0)
+			{
+				break;
+			}
+
+			JrnlHead = (JrnlHead + 1) % JRNLSIZE;
+			JrnlSeq++;
+			JrnlCount++;
+			SpiceQtyDirty &= ~(1UL << position);
+		}
+	}
+
+	return error;
+}
+
+/*=======================================================
+ * Function Name: Replay_SpiceJournal
+ *=======================================================
+ * Parameters: None
+ * Return: error
+ * Description:
+ * This function rebuilds the RAM copy of the spice
+ * quantities at start-up. The RAM copy must first be
+ * loaded from the spice data words. The newest record is
+ * found where the record sequence breaks, then the records
+ * are applied from the oldest to the newest and the
+ * journal is compacted. Start-up time is bounded, as
+ * at most 3 * JRNLSIZE words are read no matter the state
+ * of the journal.
+ *=======================================================
+ */
+uint16_t Replay_SpiceJournal(void)
+{
+	uint32_t record = 0;
+	uint32_t next = 0;
+	uint16_t newest = JRNLSIZE;
+	uint16_t indx = 0;
+
+	// Find the newest record. The record after it is older, erased or torn
+	for (indx = 0; indx < JRNLSIZE; indx++)
+	{
+		record = readEeprom(JRNLADDR + indx);
+		if (Check_JournalRecord(record) == false)
+		{
+			continue;
+		}
+
+		next = readEeprom(JRNLADDR + (indx + 1) % JRNLSIZE);
+		if (Check_JournalRecord(next) == false || (uint8_t) (next >> JRNLSEQ_S) != (uint8_t) ((record >> JRNLSEQ_S) + 1))
+		{
+			newest = indx;
+			break;
+		}
+	}
+
+	JrnlHead = 0;
+	JrnlSeq = 0;
+
+	if (newest < JRNLSIZE)
+	{
+		// Apply the records from the oldest to the newest
+		for (indx = 1; indx <= JRNLSIZE; indx++)
+		{
+			record = readEeprom(JRNLADDR + (newest + indx) % JRNLSIZE);
+			if (Check_JournalRecord(record))
+			{
+				Update_SpiceQtyCache((record >> JRNLSLOT_S) & 0x0F, (record >> JRNLQTY_S) & 0xFFF);
+			}
+		}
+
+		// The last record read was the newest
+		JrnlHead = (newest + 1) % JRNLSIZE;
+		JrnlSeq = (uint8_t) ((record >> JRNLSEQ_S) + 1);
+	}
+
+	// The number of records since the last compaction is unknown
+	return Compact_SpiceJournal();
+}
+
+/*=======================================================
+ * Function Name: Erase_SpiceJournal
+ *=======================================================
+ * Parameters: None
+ * Return: error
+ * Description:
+ * This function clears the quantity journal so it starts
+ * from the spice data words. Words that are already erased
+ * are not written again.
+ * (NOTE THIS IS A BLOCKING FUNCTION)
+ *=======================================================
+ */
+uint16_t Erase_SpiceJournal(void)
+{
+	uint16_t indx = 0;
+	uint16_t error = 0;
+
+	for (indx = 0; indx < JRNLSIZE; indx++)
+	{
+		if (readEeprom(JRNLADDR + indx) != 0xFFFFFFFF)
+		{
+			error = writeEeprom(JRNLADDR + indx, 0xFFFFFFFF);
+			if (error != 0)
+			{
+				break;
+			}
+		}
+	}
+
+	JrnlHead = 0;
+	JrnlCount = 0;
+	JrnlSeq = 0;
 
-	// Return Error Flag if any
 	return error;
 }
 
@@ -412,7 +690,9 @@ uint16_t Write_Recipe(RecipeStructType recipe)
  * Description:
  * This function is used to write a new recipe to the
  * EEPROM. A number may be provided to specify a specific
- * recipe to be updated. The function will verify that
+ * recipe to be updated. A new recipe is written to a
+ * free recipe block and added to the end of the recipe
+ * directory. The function will verify that
  * there is still enough storage left in the EEPROM
  * to allocate the recipe. The function will return 
  * an error code if any error occurs. This includes
@@ -429,37 +709,39 @@ uint16_t Write_RecipeX(RecipeStructType recipe, uint16_t number)
 	uint16_t offset = 0;
 	uint16_t stored_num = 0;
 	uint16_t error = 0;
+	uint8_t block = 0;
 
 	// Read number of currently stored recipes
 	stored_num = Read_NumofRecipes();
 
-	// Check if there is any more storage
-	if (stored_num >= MAXNUMRECP)
+	// Check if a specific recipe number was given and validate
+	if (number != 0xDEAD)
 	{
-		return ERROROOM; // Return Out of Memory Error Code 
+		// Validate the Recipe Number is a stored recipe
+		if (number >= stored_num)
+		{
+			return ERRORINVALID; // Return Invalid Error Code
+		}
+
+		block = RecipeDir[number];
 	}
+	// No specific number given, write to a free recipe block
 	else
 	{
-		// Check if a specific recipe number was given and validate
-		if (number != 0xDEAD)
+		// Check if there is any more storage
+		if (stored_num >= MAXNUMRECP)
 		{
-			// Validate the Recipe Number is within range
-			if (number >= MAXNUMRECP)
-			{
-				return ERRORINVALID; // Return Invalid Error Code
-			}
+			return ERROROOM; // Return Out of Memory Error Code
 		}
-		// No specific number given, write to next allowed position
-		else
+
+		while (RecipeBlkUsed & (1UL << block))
 		{
-			number = stored_num;
-		    // Write the remaining recipe number
-		    error = writeEeprom(SPICEDATADDR + NUMOFRECOFST, number+1);
+			block++;
 		}
 	}
 
 	// Calculate offset to the Recipe Block then write
-	offset = (number * RECBLKSIZE) + RECBLKADDR;
+	offset = (block * RECBLKSIZE) + RECBLKADDR;
 	error = Write_NameEEProm(offset, recipe.Name);
 
 	// Check if there was a write error before continuing
@@ -469,7 +751,7 @@ uint16_t Write_RecipeX(RecipeStructType recipe, uint16_t number)
 	}
 
 	// Reset Offset to Recipe Data Position
-	offset = (number * RECBLKSIZE) + RECBLKADDR + 0x04;
+	offset = (block * RECBLKSIZE) + RECBLKADDR + 0x04;
 
 	// Write the recipe data 2 positions at a time
 	for (indx = 0; indx < MAXSLOTS; indx = indx + 2)
@@ -494,6 +776,28 @@ uint16_t Write_RecipeX(RecipeStructType recipe, uint16_t number)
 		offset = offset + 1;
 	}
 
+	// Add a new recipe to the end of the directory. It is only
+	// stored once the number of recipes has been written.
+	if (number == 0xDEAD)
+	{
+		RecipeDir[stored_num] = block;
+		error = Write_RecipeDir(stored_num, stored_num + 1);
+
+		if (error == 0)
+		{
+			error = writeEeprom(SPICEDATADDR + NUMOFRECOFST, stored_num + 1);
+		}
+
+		if (error == 0)
+		{
+			RecipeBlkUsed |= 1UL << block;
+		}
+		else
+		{
+			RecipeDir[stored_num] = RECDIRNONE;
+		}
+	}
+
 	return error;
 }
 
@@ -533,12 +837,14 @@ uint16_t Write_SpiceName(uint8_t position, uint8_t *name)
  */
 uint16_t Update_RecipeName(uint8_t number, uint8_t *name)
 {
-	uint16_t offset = 0;
 	uint16_t error = 0;
 
-	offset = (number * RECBLKSIZE) + RECBLKADDR;
+	if (number >= MAXNUMRECP || RecipeDir[number] == RECDIRNONE)
+	{
+		return ERRORINVALID;
+	}
 
-	error = Write_NameEEProm(offset, name);
+	error = Write_NameEEProm(Recipe_BlockAddr(number), name);
 
 	return error;
 }
@@ -558,9 +864,12 @@ uint16_t Update_NumRecipes(uint8_t number)
  * Parameters: number
  * Return: error
  * Description:
- * This function removes a recipe from the EEPROM
- * by effectively writing the default value (0xFFFFFFFF)
- * to the EEPROM.
+ * This function removes a recipe by taking it out of
+ * the recipe directory. The recipes after it move up one
+ * number, only the directory words from the deleted
+ * entry on and the number of recipes are written. The
+ * recipe block is only freed once both are written. If
+ * either fails the directory is reloaded from the EEPROM.
  * An error code is returned if there was an issue writing
  * to the EEPROM.
  *=======================================================
@@ -568,206 +877,1104 @@ uint16_t Update_NumRecipes(uint8_t number)
 uint16_t Delete_Recipe(uint8_t number)
 {
 	uint16_t indx = 0;
-	uint16_t offset = 0;
+	uint16_t stored_num = Read_NumofRecipes();
 	uint16_t error = 0;
+	uint8_t block = 0;
 
-	// Calculate offset to the Recipe Block then write
-	offset = (number * RECBLKSIZE) + RECBLKADDR;
+	if (number >= stored_num)
+	{
+		return ERRORINVALID;
+	}
+
+	// Close the gap in the directory. The recipe blocks stay put
+	block = RecipeDir[number];
 
-	for (indx = 0; indx < RECBLKSIZE; indx++)
+	for (indx = number; indx + 1 < stored_num; indx++)
 	{
-		error = writeEeprom(offset, 0xFFFFFFFF);
-		offset = offset + 1;
+		RecipeDir[indx] = RecipeDir[indx + 1];
+	}
+	RecipeDir[stored_num - 1] = RECDIRNONE;
+
+	error = Write_RecipeDir(number, stored_num);
+
+	if (error == 0)
+	{
+		error = Update_NumRecipes(stored_num - 1);
+	}
+
+	// Bring the RAM copy back in line with what was written
+	if (error != 0)
+	{
+		Load_RecipeDir();
+		return error;
 	}
 
+	// The freed block is reused by the next new recipe
+	RecipeBlkUsed &= ~(1UL << block);
+
 	return error;
 }
 
 /*=======================================================
- * Function Name:initSpiceData
+ * Function Name: Recipe_BlockAddr
  *=======================================================
- * Parameters: reset
+ * Parameters: number
+ * Return: offset
+ * Description:
+ * This helper function looks up the EEPROM offset of the
+ * recipe block holding a recipe in the recipe directory.
+ *=======================================================
+ */
+uint16_t Recipe_BlockAddr(uint8_t number)
+{
+	return (RecipeDir[number] * RECBLKSIZE) + RECBLKADDR;
+}
+
+/*=======================================================
+ * Function Name: Write_RecipeDir
+ *=======================================================
+ * Parameters: from, to
  * Return: error
  * Description:
- * This function initializes the Spice Data Blocks
- * in the EEPROM with the default spices and quantities
- * when it is the first time the system has powered on or
- * a system reset has been requested (reset = true).
+ * This helper function writes the recipe directory words
+ * holding the entries from "from" up to (not including)
+ * "to". Each word holds four entries.
  * An error code is returned if there was an issue writing
  * to the EEPROM.
  *=======================================================
  */
-uint16_t initSpiceData(bool reset)
+uint16_t Write_RecipeDir(uint8_t from, uint8_t to)
 {
-	EEPROMDataBlockType FirstPowerUp;
 	EEPROMDataBlockType data;
-	uint16_t pos = 0;
+	uint16_t word = 0;
+	uint16_t indx = 0;
 	uint16_t error = 0;
-	uint16_t offset = 0;
-
-	// Read the First PowerUp Flag
-	FirstPowerUp.FullWord = readEeprom(SPICEINITOFST);
 
-	// If the FirstPowerUp flag doesn't match start-up key OR if a reset is requested
-	// initialize the EEPROM Spice Blocks using the defaults
-	if (FirstPowerUp.FullWord != 0xBEEF || reset == true)
+	for (word = from >> 2; (word << 2) < to; word++)
 	{
-		// Write Init Key value for next power up state.
-		error = writeEeprom(SPICEINITOFST, 0xBEEF);
-		
-		// Initialize each of the spice positions
-		for (pos = 0; pos < MAXSLOTS; pos++)
-		{
-			offset = pos >> 1;
-
-			// Write the Spice name and check for error. Abort if error.
-			error = Write_SpiceName(pos, DefaultSpices[pos].name);
-			if (error != 0)
-			{
-				break;
-			}
+		data.FullWord = 0;
 
-			// Store the data to the appropriate upper or lower 16-bit word
-			if ((pos & 0x01) == 0)
+		for (indx = 0; indx < 4; indx++)
+		{
+			if ((word << 2) + indx < MAXNUMRECP)
 			{
-				data.HalfWord.Lower16Bits = DefaultSpices[pos].data.As16BitWord;
+				data.FullWord |= (uint32_t) RecipeDir[(word << 2) + indx] << (indx * 8);
 			}
 			else
 			{
-				data.HalfWord.Upper16Bits = DefaultSpices[pos].data.As16BitWord;
-			}
-
-			// Write the spice data and check for error. Abort if error
-			error = writeEeprom(SPICEDATADDR + offset, data.FullWord);
-			if (error != 0)
-			{
-				break;
+				data.FullWord |= (uint32_t) RECDIRNONE << (indx * 8);
 			}
 		}
 
-		// Initialize number of recipes to 0.
-		error = writeEeprom(SPICEDATADDR + NUMOFRECOFST, 0);
-
-		// Remove all recipes. (For when a system reset is requested).
-		for (pos = 0; pos < MAXNUMRECP; pos++)
+		error = writeEeprom(RECDIRADDR + word, data.FullWord);
+		if (error != 0)
 		{
-			Delete_Recipe(pos);
+			break;
 		}
 	}
 
-	//Uncomment this for debugging
-	//TestEEPROM();
-
 	return error;
 }
 
 /*=======================================================
- * Function Name:TestEEPROM
+ * Function Name: Load_RecipeDir
  *=======================================================
  * Parameters: None
- * Return: None
+ * Return: error
  * Description:
- * This function is for debugging purposes and is used
- * to verify functionality of the EEPROM. The function will
+ * This function reads the recipe directory into RAM and
+ * marks the recipe blocks in use. If there is no
+ * directory yet, one is built listing the stored recipes
+ * in block order as earlier layouts stored them. Entries
+ * that are out of range or repeated (e.g. a delete that
+ * was interrupted) are dropped and the number of recipes
+ * is corrected to match.
+ * An error code is returned if there was an issue writing
+ * to the EEPROM.
+ *=======================================================
+ */
+uint16_t Load_RecipeDir(void)
+{
+	EEPROMDataBlockType data;
+	uint16_t stored_num = Read_NumofRecipes();
+	uint16_t count = 0;
+	uint16_t indx = 0;
+	uint16_t error = 0;
+
+	if (stored_num > MAXNUMRECP)
+	{
+		stored_num = MAXNUMRECP;
+	}
+
+	if (readEeprom(RECDIRKEYADDR) != RECDIRKEY)
+	{
+		for (indx = 0; indx < MAXNUMRECP; indx++)
+		{
+			RecipeDir[indx] = (indx < stored_num) ? indx : RECDIRNONE;
+		}
+
+		error = Write_RecipeDir(0, MAXNUMRECP);
+
+		if (error == 0)
+		{
+			error = writeEeprom(RECDIRKEYADDR, RECDIRKEY);
+		}
+	}
+	else
+	{
+		for (indx = 0; indx < MAXNUMRECP; indx++)
+		{
+			if ((indx & 0x03) == 0)
+			{
+				data.FullWord = readEeprom(RECDIRADDR + (indx >> 2));
+			}
+
+			RecipeDir[indx] = (data.FullWord >> ((indx & 0x03) * 8)) & 0xFF;
+		}
+	}
+
+	// Drop the entries that are out of range or repeated. A delete
+	// shifts the entries up from the start, so if it was interrupted
+	// the entry at the last written word is listed twice.
+	RecipeBlkUsed = 0;
+
+	for (indx = 0; indx < stored_num; indx++)
+	{
+		if (RecipeDir[indx] < MAXNUMRECP && (RecipeBlkUsed & (1UL << RecipeDir[indx])) == 0)
+		{
+			RecipeBlkUsed |= 1UL << RecipeDir[indx];
+			RecipeDir[count] = RecipeDir[indx];
+			count++;
+		}
+	}
+
+	for (indx = count; indx < MAXNUMRECP; indx++)
+	{
+		RecipeDir[indx] = RECDIRNONE;
+	}
+
+	if (count != Read_NumofRecipes())
+	{
+		error |= Write_RecipeDir(0, MAXNUMRECP);
+		error |= Update_NumRecipes(count);
+	}
+
+	return error;
+}
+
+/*=======================================================
+ * Function Name: Read_EEPROMLayout
+ *=======================================================
+ * Parameters: None
+ * Return: layout
+ * Description:
+ * This function checks the first power up key to find
+ * the layout the EEPROM was written in. The key of the
+ * fixed 8 slot layout is checked after the current one
+ * since its address holds a spice name in this layout.
+ *=======================================================
+ */
+EEPROMLayoutEnumType Read_EEPROMLayout(void)
+{
+	uint32_t key = readEeprom(SPICEINITOFST);
+
+	if (key == SPICEINITKEY)
+	{
+		return LAYOUT_CURRENT;
+	}
+
+	if (readEeprom(OLDSPICEINITOFST) == OLDSPICEINITKEY)
+	{
+		return LAYOUT_OLD;
+	}
+
+	if (key == 0xFFFFFFFF || key == 0)
+	{
+		return LAYOUT_BLANK;
+	}
+
+	return LAYOUT_UNKNOWN;
+}
+
+/*=======================================================
+ * Function Name: Migrate_SpiceData
+ *=======================================================
+ * Parameters: None
+ * Return: error
+ * Description:
+ * This helper function moves an EEPROM in the fixed 8
+ * slot layout to the current one. The spice names of
+ * the first 8 slots are already in place. The spice
+ * data, number of recipes and calibration words are
+ * read first, then the recipes are moved to the larger
+ * recipe blocks from the last to the first, as a new
+ * block only ever overlaps old blocks after it. Finally
+ * the slot data is written with the defaults for the
+ * new slots and the first power up key last.
+ * An error code is returned if there was an issue writing
+ * to the EEPROM.
+ * (NOTE THIS IS A BLOCKING FUNCTION)
+ *=======================================================
+ */
+uint16_t Migrate_SpiceData(void)
+{
+	uint32_t old[OLDSPICEINITOFST - OLDSPICEDATADDR];
+	EEPROMDataBlockType data;
+	AugerCalibType calib;
+	uint16_t num_recipes = 0;
+	uint16_t number = 0;
+	uint16_t indx = 0;
+	uint16_t pos = 0;
+	uint16_t error = 0;
+
+	// Spice data, number of recipes and calibration of the 8 slots
+	for (indx = 0; indx < OLDSPICEINITOFST - OLDSPICEDATADDR; indx++)
+	{
+		old[indx] = readEeprom(OLDSPICEDATADDR + indx);
+	}
+
+	num_recipes = old[OLDSLOTS / 2] & 0xFFFF;
+	num_recipes = (num_recipes > OLDMAXNUMRECP) ? OLDMAXNUMRECP : num_recipes;
+
+	// Move each recipe. The slots added after the old data are
+	// left empty (zero quantity ends the recipe)
+	for (number = num_recipes; (number > 0) && (error == 0); number--)
+	{
+		for (indx = 0; (indx < RECBLKSIZE) && (error == 0); indx++)
+		{
+			data.FullWord = 0;
+
+			if (indx < OLDRECBLKSIZE)
+			{
+				data.FullWord = readEeprom(OLDRECBLKADDR + (number - 1) * OLDRECBLKSIZE + indx);
+			}
+
+			error = writeEeprom(RECBLKADDR + (number - 1) * RECBLKSIZE + indx, data.FullWord);
+		}
+	}
+
+	if (error != 0)
+	{
+		return error;
+	}
+
+	// The old spice data words are the first of the new ones
+	for (indx = 0; indx < OLDSLOTS / 2; indx++)
+	{
+		error |= writeEeprom(SPICEDATADDR + indx, old[indx]);
+		error |= writeEeprom(SPICEDATADDR + CALIBDOSEOFST + indx, old[(OLDSLOTS / 2) + 3 + indx]);
+		error |= writeEeprom(SPICEDATADDR + CALIBAUGEROFST + indx, old[OLDSLOTS + 3 + indx]);
+	}
+
+	error |= writeEeprom(SPICEDATADDR + NUMOFRECOFST, num_recipes);
+	error |= writeEeprom(SPICEDATADDR + CALIBHOMEOFST, old[(OLDSLOTS / 2) + 1]);
+	error |= writeEeprom(SPICEDATADDR + CALIBSVOOFST, old[(OLDSLOTS / 2) + 2]);
+
+	// The new slots get the default spices and calibration
+	calib.DataBits.speed = DEFAULTAUGERSPD;
+	calib.DataBits.ramp = DEFAULTAUGERRAMP;
+
+	for (pos = OLDSLOTS; pos < MAXSLOTS; pos++)
+	{
+		error |= Write_SpiceName(pos, DefaultSpices[pos].name);
+
+		if ((pos & 0x01) == 0)
+		{
+			data.HalfWord.Lower16Bits = DefaultSpices[pos].data.As16BitWord;
+		}
+		else
+		{
+			data.HalfWord.Upper16Bits = DefaultSpices[pos].data.As16BitWord;
+			error |= writeEeprom(SPICEDATADDR + (pos >> 1), data.FullWord);
+		}
+
+		error |= Write_DoseCalib(pos, DEFAULTDOSE);
+		error |= Write_AugerCalib(pos, calib);
+	}
+
+	for (pos = 0; pos < MAXSLOTS; pos++)
+	{
+		error |= Write_SlotAngle(pos, SLOTANGLENONE);
+	}
+
+	error |= Write_NumofSlots(OLDSLOTS);
+
+	// The rack state, rack tune and recipe directory words were
+	// recipe data in the old layout. Clear them so none is trusted
+	for (indx = 0; indx < 3; indx++)
+	{
+		error |= writeEeprom(RACKSTATEADDR + indx, 0);
+	}
+
+	error |= writeEeprom(RACKTUNEADDR, 0xFFFFFFFF);
+	error |= writeEeprom(RECDIRKEYADDR, 0);
+
+	if (error == 0)
+	{
+		error = writeEeprom(SPICEINITOFST, SPICEINITKEY);
+	}
+
+	return error;
+}
+
+/*=======================================================
+ * Function Name: Save_DroppedRecipes
+ *=======================================================
+ * Parameters: None
+ * Return: None
+ * Description:
+ * This helper function keeps the names of the recipes
+ * that no longer fit when the recipe directory is first
+ * built. Earlier layouts stored the recipes in order in
+ * the blocks, so any past MAXNUMRECP are in the space the
+ * recipe directory and the journal now use. It must be
+ * called before either is written.
+ *=======================================================
+ */
+void Save_DroppedRecipes(void)
+{
+	uint16_t stored_num = Read_NumofRecipes();
+	uint16_t number = 0;
+
+	NumDroppedRecipes = 0;
+
+	if (readEeprom(RECDIRKEYADDR) == RECDIRKEY)
+	{
+		return;
+	}
+
+	for (number = MAXNUMRECP; (number < stored_num) && (NumDroppedRecipes < MAXDROPRECP); number++)
+	{
+		strncpy((char*) DroppedRecipes[NumDroppedRecipes],
+				(char*) Read_NameEEProm((number * RECBLKSIZE) + RECBLKADDR), MAXNAMESIZE - 1);
+		DroppedRecipes[NumDroppedRecipes][MAXNAMESIZE - 1] = '\0';
+		NumDroppedRecipes++;
+	}
+}
+
+/*=======================================================
+ * Function Name: Read_NumDroppedRecipes
+ *=======================================================
+ * Parameters: None
+ * Return: number
+ * Description:
+ * This function returns the number of recipes that were
+ * dropped at start-up as they no longer fit the EEPROM.
+ *=======================================================
+ */
+uint8_t Read_NumDroppedRecipes(void)
+{
+	return NumDroppedRecipes;
+}
+
+/*=======================================================
+ * Function Name: Read_DroppedRecipe
+ *=======================================================
+ * Parameters: number
+ * Return: name
+ * Description:
+ * This function returns the name of a recipe that was
+ * dropped at start-up. If an invalid number is given an
+ * "Invalid" Error code will be returned instead.
+ *=======================================================
+ */
+uint8_t* Read_DroppedRecipe(uint8_t number)
+{
+	if (number >= NumDroppedRecipes)
+	{
+		return (uint8_t *) ERRORINVALID;
+	}
+
+	return DroppedRecipes[number];
+}
+
+/*=======================================================
+ * Function Name:initSpiceData
+ *=======================================================
+ * Parameters: reset
+ * Return: error
+ * Description:
+ * This function initializes the Spice Data Blocks
+ * in the EEPROM with the default spices and quantities
+ * when it is the first time the system has powered on or
+ * a system reset has been requested (reset = true). An
+ * EEPROM in the fixed 8 slot layout is moved to the
+ * current layout instead (See Migrate_SpiceData).
+ * The RAM copy of the spice quantities is then loaded
+ * and the quantity journal replayed over it. Finally
+ * the recipe directory is loaded. Recipes of an earlier
+ * layout that no longer fit are dropped and can be listed
+ * with Read_DroppedRecipe.
+ * An error code is returned if there was an issue writing
+ * to the EEPROM.
+ *=======================================================
+ */
+uint16_t initSpiceData(bool reset)
+{
+	EEPROMLayoutEnumType layout;
+	EEPROMDataBlockType data;
+	AugerCalibType calib;
+	uint16_t pos = 0;
+	uint16_t error = 0;
+	uint16_t offset = 0;
+
+	// Check the First PowerUp key
+	layout = Read_EEPROMLayout();
+
+	// Keep the spices, calibration and recipes of the 8 slot layout
+	if (layout == LAYOUT_OLD && reset == false)
+	{
+		error = Migrate_SpiceData();
+	}
+	// If the FirstPowerUp key doesn't match start-up key OR if a reset is requested
+	// initialize the EEPROM Spice Blocks using the defaults
+	else if (layout != LAYOUT_CURRENT || reset == true)
+	{
+		// Write Init Key value for next power up state.
+		error = writeEeprom(SPICEINITOFST, SPICEINITKEY);
+		
+		// Initialize each of the spice positions
+		for (pos = 0; pos < MAXSLOTS; pos++)
+		{
+			offset = pos >> 1;
+
+			// Write the Spice name and check for error. Abort if error.
+			error = Write_SpiceName(pos, DefaultSpices[pos].name);
+			if (error != 0)
+			{
+				break;
+			}
+
+			// Store the data to the appropriate upper or lower 16-bit word
+			if ((pos & 0x01) == 0)
+			{
+				data.HalfWord.Lower16Bits = DefaultSpices[pos].data.As16BitWord;
+			}
+			else
+			{
+				data.HalfWord.Upper16Bits = DefaultSpices[pos].data.As16BitWord;
+			}
+
+			// Write the spice data and check for error. Abort if error
+			error = writeEeprom(SPICEDATADDR + offset, data.FullWord);
+			if (error != 0)
+			{
+				break;
+			}
+		}
+
+		// Initialize the dose calibration and auger profile of each slot
+		calib.DataBits.speed = DEFAULTAUGERSPD;
+		calib.DataBits.ramp = DEFAULTAUGERRAMP;
+
+		for (pos = 0; pos < MAXSLOTS; pos++)
+		{
+			Write_DoseCalib(pos, DEFAULTDOSE);
+			Write_AugerCalib(pos, calib);
+			Write_SlotAngle(pos, SLOTANGLENONE);
+		}
+
+		// Initialize the carousel to the default number of slots
+		Write_NumofSlots(DEFAULTSLOTS);
+
+		// Initialize number of recipes to 0. This empties the
+		// recipe directory (For when a system reset is requested).
+		error = writeEeprom(SPICEDATADDR + NUMOFRECOFST, 0);
+	}
+
+	// Keep the names of the recipes the journal and the recipe
+	// directory are about to overwrite
+	if (layout == LAYOUT_CURRENT && reset == false)
+	{
+		Save_DroppedRecipes();
+	}
+
+	// Start a new quantity journal after a reset, or when the journal
+	// area is first used as it may hold recipe blocks of an older layout
+	if (layout != LAYOUT_CURRENT || reset == true || readEeprom(JRNLKEYADDR) != JRNLKEY)
+	{
+		error |= Erase_SpiceJournal();
+
+		if (error == 0)
+		{
+			error = writeEeprom(JRNLKEYADDR, JRNLKEY);
+		}
+	}
+
+	// Load the RAM copy of the spice data and bring it up to date
+	// from the journal. Quantities not yet written back are dropped
+	// when the defaults replace them.
+	for (pos = 0; pos < MAXSLOTS / 2; pos++)
+	{
+		SpiceQty[pos].FullWord = readEeprom(SPICEDATADDR + pos);
+	}
+	SpiceQtyDirty = 0;
+	error |= Replay_SpiceJournal();
+
+	// Load the recipe directory. Recipes of an older layout that no
+	// longer fit are dropped here (See Save_DroppedRecipes)
+	error |= Load_RecipeDir();
+
+	//Uncomment this for debugging
+	//TestEEPROM();
+
+	return error;
+}
+
+/*=======================================================
+ * Function Name:TestEEPROM
+ *=======================================================
+ * Parameters: None
+ * Return: None
+ * Description:
+ * This function is for debugging purposes and is used
+ * to verify functionality of the EEPROM. The function will
  * write a set of recipes to the EEPROM.
  * The recipes can then be read back to validate EEPROM
  * storage.
  *=======================================================
  */
-void TestEEPROM(void)
+void TestEEPROM(void)
+{
+	// Recipes for testing EEPROM
+	RecipeStructType test_recipes[8] =
+	{
+		{"CAJUN", {0x41, 0x12}},
+		{"ITALIAN", {0x63, 0x24, 0x55, 0x16}},
+		{"BEEF", {0x123, 0x456, 0x789}},
+		{"ABCD1234", {0xABC, 0xDEF, 0xBEEF}},
+		{"LOL", {0xDEAD, 0xFACE, 0xBABE}},
+		{"FEISTY", {0xBEAD, 0xDEAF, 0xCEED}},
+		{"REC4", {0xBEAC, 0x1234, 0x5678}},
+		{"REC5", {0xBADE, 0xDADE, 0xCACE}},
+	};
+
+	int x = 0;
+	uint16_t error = 0;
+
+	// Initialize number of recipes to 0.
+	error = writeEeprom(SPICEDATADDR + NUMOFRECOFST, 0);
+
+	for (x = 0; x < 8; x++)
+	{
+		error = Write_Recipe(test_recipes[x]);
+	}
+}
+
+uint16_t Write_CalibVal(uint16_t type, int16_t value)
+{
+	EEPROMDataBlockType eeprom_data = { 0, };
+	uint16_t offset = 0;
+	uint16_t error = 0;
+
+	switch (type)
+	{
+	case 0: // Home Calibration
+		offset = SPICEDATADDR + CALIBHOMEOFST;
+		// Read the current word since we only need to write to half
+		eeprom_data.FullWord = readEeprom(offset);
+		eeprom_data.HalfWord.Lower16Bits = (uint16_t) value;
+		break;
+	case 1: // Auger Calibration
+		offset = SPICEDATADDR + CALIBHOMEOFST;
+		// Read the current word since we only need to write to half
+		eeprom_data.FullWord = readEeprom(offset);
+		eeprom_data.HalfWord.Upper16Bits = (uint16_t) value;
+		break;
+	case 2: // Servo Enage Calibration
+		offset = SPICEDATADDR + CALIBSVOOFST;
+		// Read the current word since we only need to write to half
+		eeprom_data.FullWord = readEeprom(offset);
+		eeprom_data.HalfWord.Lower16Bits = (uint16_t) value;
+		break;
+	case 3: // Servo Disengage Calibration
+		offset = SPICEDATADDR + CALIBSVOOFST;
+		// Read the current word since we only need to write to half
+		eeprom_data.FullWord = readEeprom(offset);
+		eeprom_data.HalfWord.Upper16Bits = (uint16_t) value;
+		break;
+	}
+
+	// Write the Data to the EEPROM. (NOTE THIS IS A BLOCKING FUNCTION)
+	error = writeEeprom(offset, eeprom_data.FullWord);
+
+	// Return Error Flag if any
+	return error;
+}
+
+int16_t Read_CalibVal(uint16_t type)
+{
+	EEPROMDataBlockType eeprom_data;
+	uint16_t offset = 0;
+	uint16_t error = 0;
+
+	switch (type)
+	{
+	case 0: // Home Calibration
+		offset = SPICEDATADDR + CALIBHOMEOFST;
+		eeprom_data.FullWord = readEeprom(offset);
+		return eeprom_data.HalfWord.Lower16Bits;
+	case 1: // Auger Calibration
+		offset = SPICEDATADDR + CALIBHOMEOFST;
+		eeprom_data.FullWord = readEeprom(offset);
+		return eeprom_data.HalfWord.Upper16Bits;
+	case 2: // Servo Enage Calibration
+		offset = SPICEDATADDR + CALIBSVOOFST;
+		eeprom_data.FullWord = readEeprom(offset);
+		return eeprom_data.HalfWord.Lower16Bits;
+	case 3: // Servo Disengage Calibration
+		offset = SPICEDATADDR + CALIBSVOOFST;
+		eeprom_data.FullWord = readEeprom(offset);
+		return eeprom_data.HalfWord.Upper16Bits;
+	default:
+		break;
+	}
+	return 0;
+}
+
+/*=======================================================
+ * Function Name: Write_DoseCalib
+ *=======================================================
+ * Parameters: position, microsteps
+ * Return: error
+ * Description:
+ * This function saves the dose calibration of a slot, the
+ * number of auger microsteps that dispense one
+ * half-teaspoon. Two slots are stored per 32-bit word in
+ * the same way as the spice data.
+ *=======================================================
+ */
+uint16_t Write_DoseCalib(uint8_t position, uint16_t microsteps)
+{
+	EEPROMDataBlockType data;
+	uint16_t offset = 0;
+
+	if (position > MAXSLOTS - 1)
+	{
+		return ERRORINVALID;
+	}
+
+	offset = SPICEDATADDR + CALIBDOSEOFST + (position >> 1);
+
+	// Read the current word since we only need to write to half
+	data.FullWord = readEeprom(offset);
+
+	if ((position & 0x01) == 0)
+	{
+		data.HalfWord.Lower16Bits = microsteps;
+	}
+	else
+	{
+		data.HalfWord.Upper16Bits = microsteps;
+	}
+
+	return writeEeprom(offset, data.FullWord);
+}
+
+/*=======================================================
+ * Function Name: Read_DoseCalib
+ *=======================================================
+ * Parameters: position
+ * Return: microsteps
+ * Description:
+ * This function reads the dose calibration of a slot. If
+ * the slot has never been calibrated (erased or zero) the
+ * default of one full auger rotation is returned.
+ *=======================================================
+ */
+uint16_t Read_DoseCalib(uint8_t position)
+{
+	EEPROMDataBlockType data;
+	uint16_t microsteps = 0;
+
+	if (position > MAXSLOTS - 1)
+	{
+		return DEFAULTDOSE;
+	}
+
+	data.FullWord = readEeprom(SPICEDATADDR + CALIBDOSEOFST + (position >> 1));
+
+	if ((position & 0x01) == 0)
+	{
+		microsteps = data.HalfWord.Lower16Bits;
+	}
+	else
+	{
+		microsteps = data.HalfWord.Upper16Bits;
+	}
+
+	if (microsteps == 0 || microsteps == 0xFFFF)
+	{
+		microsteps = DEFAULTDOSE;
+	}
+
+	return microsteps;
+}
+
+/*=======================================================
+ * Function Name: Write_AugerCalib
+ *=======================================================
+ * Parameters: position, calib
+ * Return: error
+ * Description:
+ * This function saves the auger speed and ramp rate used
+ * to dispense the spice of a slot. Two slots are stored
+ * per 32-bit word.
+ *=======================================================
+ */
+uint16_t Write_AugerCalib(uint8_t position, AugerCalibType calib)
+{
+	EEPROMDataBlockType data;
+	uint16_t offset = 0;
+
+	if (position > MAXSLOTS - 1)
+	{
+		return ERRORINVALID;
+	}
+
+	offset = SPICEDATADDR + CALIBAUGEROFST + (position >> 1);
+
+	// Read the current word since we only need to write to half
+	data.FullWord = readEeprom(offset);
+
+	if ((position & 0x01) == 0)
+	{
+		data.HalfWord.Lower16Bits = calib.As16BitWord;
+	}
+	else
+	{
+		data.HalfWord.Upper16Bits = calib.As16BitWord;
+	}
+
+	return writeEeprom(offset, data.FullWord);
+}
+
+/*=======================================================
+ * Function Name: Read_AugerCalib
+ *=======================================================
+ * Parameters: position
+ * Return: calib
+ * Description:
+ * This function reads the auger speed and ramp rate of a
+ * slot. A value that has never been written (erased or
+ * zero) is replaced by its default.
+ *=======================================================
+ */
+AugerCalibType Read_AugerCalib(uint8_t position)
 {
-	// Recipes for testing EEPROM
-	RecipeStructType test_recipes[8] =
+	EEPROMDataBlockType data;
+	AugerCalibType calib;
+
+	calib.DataBits.speed = DEFAULTAUGERSPD;
+	calib.DataBits.ramp = DEFAULTAUGERRAMP;
+
+	if (position > MAXSLOTS - 1)
 	{
-		{"CAJUN", {0x41, 0x12}},
-		{"ITALIAN", {0x63, 0x24, 0x55, 0x16}},
-		{"BEEF", {0x123, 0x456, 0x789}},
-		{"ABCD1234", {0xABC, 0xDEF, 0xBEEF}},
-		{"LOL", {0xDEAD, 0xFACE, 0xBABE}},
-		{"FEISTY", {0xBEAD, 0xDEAF, 0xCEED}},
-		{"REC4", {0xBEAC, 0x1234, 0x5678}},
-		{"REC5", {0xBADE, 0xDADE, 0xCACE}},
-	};
+		return calib;
+	}
 
-	int x = 0;
-	uint16_t error = 0;
+	data.FullWord = readEeprom(SPICEDATADDR + CALIBAUGEROFST + (position >> 1));
 
-	// Initialize number of recipes to 0.
-	error = writeEeprom(SPICEDATADDR + NUMOFRECOFST, 0);
+	if ((position & 0x01) == 0)
+	{
+		calib.As16BitWord = data.HalfWord.Lower16Bits;
+	}
+	else
+	{
+		calib.As16BitWord = data.HalfWord.Upper16Bits;
+	}
 
-	for (x = 0; x < 8; x++)
+	if (calib.DataBits.speed == 0 || calib.DataBits.speed == 0xFF)
 	{
-		error = Write_Recipe(test_recipes[x]);
+		calib.DataBits.speed = DEFAULTAUGERSPD;
+	}
+
+	if (calib.DataBits.ramp == 0 || calib.DataBits.ramp == 0xFF)
+	{
+		calib.DataBits.ramp = DEFAULTAUGERRAMP;
 	}
+
+	return calib;
 }
 
-uint16_t Write_CalibVal(uint16_t type, int16_t value)
+/*=======================================================
+ * Function Name: Write_NumofSlots
+ *=======================================================
+ * Parameters: slots
+ * Return: error
+ * Description:
+ * This function saves the number of slots of the
+ * carousel. An invalid error code is returned if the
+ * number is more than the EEPROM layout has room for.
+ *=======================================================
+ */
+uint16_t Write_NumofSlots(uint8_t slots)
 {
-	EEPROMDataBlockType eeprom_data = { 0, };
+	if (slots < 2 || slots > MAXSLOTS)
+	{
+		return ERRORINVALID;
+	}
+
+	return writeEeprom(SPICEDATADDR + NUMOFSLOTSOFST, slots);
+}
+
+/*=======================================================
+ * Function Name: Read_NumofSlots
+ *=======================================================
+ * Parameters: None
+ * Return: slots
+ * Description:
+ * This function reads the number of slots of the
+ * carousel. The default is returned if no valid number
+ * has been saved.
+ *=======================================================
+ */
+uint8_t Read_NumofSlots(void)
+{
+	uint32_t slots = readEeprom(SPICEDATADDR + NUMOFSLOTSOFST);
+
+	if (slots < 2 || slots > MAXSLOTS)
+	{
+		slots = DEFAULTSLOTS;
+	}
+
+	return (uint8_t) slots;
+}
+
+/*=======================================================
+ * Function Name: Write_SlotAngle
+ *=======================================================
+ * Parameters: position, microsteps
+ * Return: error
+ * Description:
+ * This function saves the calibrated angle of a slot as
+ * rack microsteps from the home position. Writing
+ * SLOTANGLENONE returns the slot to the even spacing.
+ * Two slots are stored per 32-bit word.
+ *=======================================================
+ */
+uint16_t Write_SlotAngle(uint8_t position, uint16_t microsteps)
+{
+	EEPROMDataBlockType data;
 	uint16_t offset = 0;
-	uint16_t error = 0;
 
-	switch (type)
+	if (position > MAXSLOTS - 1)
 	{
-	case 0: // Home Calibration
-		offset = SPICEDATADDR + CALIBHOMEOFST;
-		// Read the current word since we only need to write to half
-		eeprom_data.FullWord = readEeprom(offset);
-		eeprom_data.HalfWord.Lower16Bits = (uint16_t) value;
-		break;
-	case 1: // Auger Calibration
-		offset = SPICEDATADDR + CALIBHOMEOFST;
-		// Read the current word since we only need to write to half
-		eeprom_data.FullWord = readEeprom(offset);
-		eeprom_data.HalfWord.Upper16Bits = (uint16_t) value;
-		break;
-	case 2: // Servo Enage Calibration
-		offset = SPICEDATADDR + CALIBSVOOFST;
-		// Read the current word since we only need to write to half
-		eeprom_data.FullWord = readEeprom(offset);
-		eeprom_data.HalfWord.Lower16Bits = (uint16_t) value;
-		break;
-	case 3: // Servo Disengage Calibration
-		offset = SPICEDATADDR + CALIBSVOOFST;
-		// Read the current word since we only need to write to half
-		eeprom_data.FullWord = readEeprom(offset);
-		eeprom_data.HalfWord.Upper16Bits = (uint16_t) value;
-		break;
+		return ERRORINVALID;
 	}
 
-	// Write the Data to the EEPROM. (NOTE THIS IS A BLOCKING FUNCTION)
-	error = writeEeprom(offset, eeprom_data.FullWord);
+	offset = SPICEDATADDR + CALIBANGLEOFST + (position >> 1);
 
-	// Return Error Flag if any
-	return error;
+	// Read the current word since we only need to write to half
+	data.FullWord = readEeprom(offset);
+
+	if ((position & 0x01) == 0)
+	{
+		data.HalfWord.Lower16Bits = microsteps;
+	}
+	else
+	{
+		data.HalfWord.Upper16Bits = microsteps;
+	}
+
+	return writeEeprom(offset, data.FullWord);
 }
 
-int16_t Read_CalibVal(uint16_t type)
+/*=======================================================
+ * Function Name: Read_SlotAngle
+ *=======================================================
+ * Parameters: position
+ * Return: microsteps
+ * Description:
+ * This function reads the calibrated angle of a slot in
+ * rack microsteps. SLOTANGLENONE is returned if the slot
+ * has not been calibrated, in which case the slot is
+ * evenly spaced.
+ *=======================================================
+ */
+uint16_t Read_SlotAngle(uint8_t position)
 {
-	EEPROMDataBlockType eeprom_data;
+	EEPROMDataBlockType data;
+
+	if (position > MAXSLOTS - 1)
+	{
+		return SLOTANGLENONE;
+	}
+
+	data.FullWord = readEeprom(SPICEDATADDR + CALIBANGLEOFST + (position >> 1));
+
+	if ((position & 0x01) == 0)
+	{
+		return data.HalfWord.Lower16Bits;
+	}
+
+	return data.HalfWord.Upper16Bits;
+}
+
+/*=======================================================
+ * Function Name: Write_RackState
+ *=======================================================
+ * Parameters: state
+ * Return: error
+ * Description:
+ * This function saves the rack state to the EEPROM along
+ * with a checksum. Only the words that changed are written
+ * to limit wear (See SaveRackState).
+ * The checksum is written last, so an interrupted write
+ * reads back as invalid.
+ *=======================================================
+ */
+uint16_t Write_RackState(RackStateStructType state)
+{
+	EEPROMDataBlockType status;
+	uint32_t words[3];
 	uint16_t offset = 0;
 	uint16_t error = 0;
 
-	switch (type)
+	status.HalfWord.Lower16Bits = state.clean;
+	status.HalfWord.Upper16Bits = state.hall;
+
+	words[RACKSTATEPOSOFST] = (uint32_t) state.position;
+	words[RACKSTATESTATOFST] = status.FullWord;
+	words[RACKSTATESUMOFST] = (words[RACKSTATEPOSOFST] + words[RACKSTATESTATOFST]) ^ RACKSTATEKEY;
+
+	for (offset = 0; offset < 3; offset++)
 	{
-	case 0: // Home Calibration
-		offset = SPICEDATADDR + CALIBHOMEOFST;
-		eeprom_data.FullWord = readEeprom(offset);
-		return eeprom_data.HalfWord.Lower16Bits;
-	case 1: // Auger Calibration
-		offset = SPICEDATADDR + CALIBHOMEOFST;
-		eeprom_data.FullWord = readEeprom(offset);
-		return eeprom_data.HalfWord.Upper16Bits;
-	case 2: // Servo Enage Calibration
-		offset = SPICEDATADDR + CALIBSVOOFST;
-		eeprom_data.FullWord = readEeprom(offset);
-		return eeprom_data.HalfWord.Lower16Bits;
-	case 3: // Servo Disengage Calibration
-		offset = SPICEDATADDR + CALIBSVOOFST;
-		eeprom_data.FullWord = readEeprom(offset);
-		return eeprom_data.HalfWord.Upper16Bits;
-	default:
-		break;
+		if (readEeprom(RACKSTATEADDR + offset) != words[offset])
+		{
+			error = writeEeprom(RACKSTATEADDR + offset, words[offset]);
+			if (error != 0)
+			{
+				break;
+			}
+		}
+	}
+
+	return error;
+}
+
+/*=======================================================
+ * Function Name: Read_RackState
+ *=======================================================
+ * Parameters: state
+ * Return: error
+ * Description:
+ * This function reads the saved rack state from the
+ * EEPROM. An invalid error code is returned if the
+ * checksum does not match, in which case the state must
+ * not be used.
+ *=======================================================
+ */
+uint16_t Read_RackState(RackStateStructType* state)
+{
+	EEPROMDataBlockType status;
+	uint32_t position = 0;
+	uint32_t checksum = 0;
+
+	position = readEeprom(RACKSTATEADDR + RACKSTATEPOSOFST);
+	status.FullWord = readEeprom(RACKSTATEADDR + RACKSTATESTATOFST);
+	checksum = readEeprom(RACKSTATEADDR + RACKSTATESUMOFST);
+
+	if (((position + status.FullWord) ^ RACKSTATEKEY) != checksum)
+	{
+		return ERRORINVALID;
+	}
+
+	state->position = (int32_t) position;
+	state->clean = status.HalfWord.Lower16Bits;
+	state->hall = status.HalfWord.Upper16Bits;
+
+	return 0;
+}
+
+/*=======================================================
+ * Function Name: Write_RackTune
+ *=======================================================
+ * Parameters: speed, accel
+ * Return: error
+ * Description:
+ * This function saves the rack speed (RPM) and
+ * acceleration (Q16 RPM per microstep) found by the
+ * auto-tune routine.
+ *=======================================================
+ */
+uint16_t Write_RackTune(uint16_t speed, uint16_t accel)
+{
+	EEPROMDataBlockType data;
+
+	data.HalfWord.Lower16Bits = speed;
+	data.HalfWord.Upper16Bits = accel;
+
+	return writeEeprom(RACKTUNEADDR, data.FullWord);
+}
+
+/*=======================================================
+ * Function Name: Read_RackTune
+ *=======================================================
+ * Parameters: speed, accel
+ * Return: error
+ * Description:
+ * This function reads the saved rack speed and
+ * acceleration. An invalid error code is returned if the
+ * rack has never been tuned, in which case the defaults
+ * should be kept.
+ *=======================================================
+ */
+uint16_t Read_RackTune(uint16_t* speed, uint16_t* accel)
+{
+	EEPROMDataBlockType data;
+
+	data.FullWord = readEeprom(RACKTUNEADDR);
+
+	if (data.HalfWord.Lower16Bits == 0 || data.HalfWord.Lower16Bits == 0xFFFF ||
+		data.HalfWord.Upper16Bits == 0 || data.HalfWord.Upper16Bits == 0xFFFF)
+	{
+		return ERRORINVALID;
+	}
+
+	*speed = data.HalfWord.Lower16Bits;
+	*accel = data.HalfWord.Upper16Bits;
+
+	return 0;
+}
+
+/*=======================================================
+ * Function Name: Write_ServoSlew
+ *=======================================================
+ * Parameters: slew
+ * Return: error
+ * Description:
+ * This function saves the calibrated servo slew rate
+ * (microseconds per degree).
+ *=======================================================
+ */
+uint16_t Write_ServoSlew(uint16_t slew)
+{
+	return writeEeprom(SERVOSLEWADDR, slew);
+}
+
+/*=======================================================
+ * Function Name: Read_ServoSlew
+ *=======================================================
+ * Parameters: slew
+ * Return: error
+ * Description:
+ * This function reads the saved servo slew rate. An
+ * invalid error code is returned if the slew rate has
+ * never been calibrated, in which case the default
+ * should be kept.
+ *=======================================================
+ */
+uint16_t Read_ServoSlew(uint16_t* slew)
+{
+	uint32_t data = readEeprom(SERVOSLEWADDR);
+
+	if (data == 0 || data > 0xFFFF)
+	{
+		return ERRORINVALID;
 	}
+
+	*slew = (uint16_t) data;
+
 	return 0;
 }
@@ -20,26 +20,115 @@
  */
 
 // Address offsets to EEPROM Data blocks
+// The layout is sized for MAXSLOTS. Each slot has a 4 word name
+// and a half word of spice data, dose calibration, auger profile
+// and angle in the slot data block. The recipes fill the rest of
+// the EEPROM.
+#define EEPROMSIZE 0x0200
 #define SPICENMADDR 0x0000
-#define SPICEDATADDR 0x0020
-#define SPICEINITOFST 0x002F
-#define NUMOFRECOFST 0x04
-#define CALIBHOMEOFST 0x05
-#define CALIBSVOOFST 0x06
-#define RECBLKADDR 0x0030
-#define RECBLKSIZE 0x08
+#define SPICEDATADDR (SPICENMADDR + MAXSLOTS * 4)
+#define NUMOFRECOFST (MAXSLOTS / 2)
+#define CALIBHOMEOFST (NUMOFRECOFST + 1)
+#define CALIBSVOOFST (NUMOFRECOFST + 2)
+#define CALIBDOSEOFST (NUMOFRECOFST + 3)
+#define CALIBAUGEROFST (CALIBDOSEOFST + MAXSLOTS / 2)
+#define CALIBANGLEOFST (CALIBAUGEROFST + MAXSLOTS / 2)
+#define NUMOFSLOTSOFST (CALIBANGLEOFST + MAXSLOTS / 2)
+#define SPICEINITOFST (SPICEDATADDR + NUMOFSLOTSOFST + 1)
+#define RACKSTATEADDR (SPICEINITOFST + 1)
+#define RACKSTATEPOSOFST 0x00
+#define RACKSTATESTATOFST 0x01
+#define RACKSTATESUMOFST 0x02
+#define RACKTUNEADDR (RACKSTATEADDR + 3)
+#define RECBLKADDR (RACKTUNEADDR + 1)
+#define RECBLKSIZE (4 + MAXSLOTS / 2)
+
+// System words kept at the top of the EEPROM, after the recipes,
+// so they do not move with the slot layout
+#define SYSBLKSIZE 0x08
+#define SYSBLKADDR (EEPROMSIZE - SYSBLKSIZE)
+#define SERVOSLEWADDR (SYSBLKADDR + 0x00)
+#define JRNLKEYADDR (SYSBLKADDR + 0x01)
+#define RECDIRKEYADDR (SYSBLKADDR + 0x02)
+
+// Spice quantity journal. A ring of whole EEPROM blocks just below
+// the system words. Each quantity change is appended as one record
+// so the writes are spread across the blocks instead of wearing
+// out the spice data words. See Flush_SpiceRemQty
+#define EEPROMBLKSIZE 0x10
+#define JRNLBLOCKS 4
+#define JRNLSIZE (JRNLBLOCKS * EEPROMBLKSIZE)
+#define JRNLADDR ((SYSBLKADDR & ~(EEPROMBLKSIZE - 1)) - JRNLSIZE)
+
+// Journal Record: Sequence (31:24), Slot (23:20), Quantity (19:8)
+// and Check (7:0). The check never matches an erased (all 1's) or
+// zeroed word.
+#define JRNLSEQ_S 24
+#define JRNLSLOT_S 20
+#define JRNLQTY_S 8
+#define JRNLCHECKKEY 0xA5
+#define JRNLCHECK(record) ((uint8_t) ((((record) >> 24) + ((record) >> 16) + ((record) >> 8)) ^ JRNLCHECKKEY))
+
+// Recipe Directory. The recipes are listed in order by the
+// number of the recipe block holding each one, four per word, so
+// a recipe is added or deleted without moving any recipe blocks.
+// The directory sits between the recipe blocks and the journal.
+#define RECDIRSIZE ((MAXNUMRECP + 3) / 4)
+#define RECDIRADDR (JRNLADDR - RECDIRSIZE)
+#define RECDIRNONE 0xFF     // Unused directory entry
+
+// Recipe directory key. Written once the directory has been built,
+// as earlier layouts stored the recipes in order in the blocks
+#define RECDIRKEY 0xD1A0BEEF
+
+// Journal area key. Written once the journal area is cleared, so
+// recipe blocks left there by an earlier layout are never replayed
+#define JRNLKEY 0x10C0BEEF
+
+// First power up key. Includes the slot count of the layout so
+// the EEPROM is re-initialized if the layout changes
+#define SPICEINITKEY (0xBEEF0000 | MAXSLOTS)
+
+// Fixed 8 slot layout of earlier versions. Its spices, calibration
+// and recipes are moved to the current layout once. The spice data
+// words are laid out as the current ones with 8 slots, followed by
+// the first power up key. See Migrate_SpiceData
+#define OLDSPICEINITKEY 0xBEEF
+#define OLDSLOTS 8
+#define OLDSPICEDATADDR 0x0020
+#define OLDSPICEINITOFST 0x002F
+#define OLDRECBLKADDR 0x0030
+#define OLDRECBLKSIZE 0x08
+#define OLDMAXNUMRECP 26
+
+// Key mixed into the rack state checksum so an erased
+// (all 1's) or zeroed block never reads as valid
+#define RACKSTATEKEY 0x5AFEBEEF
 
 // Max System Values
 #define MAXNAMESIZE 16
-#define MAXSLOTS 8
+#define MAXSLOTS 16 // Largest carousel. Limited by the 4-bit position of the spice data
+#define DEFAULTSLOTS 8
+#define SLOTANGLENONE 0xFFFF // Angle of a slot that has not been calibrated
 #define MAXQTY 96 // Quantity is in half-teaspoons
+#define DEFAULTDOSE 3200 // Auger microsteps per half-teaspoon (One full rotation)
+#define DEFAULTAUGERSPD 35 // Auger speed (RPM)
+#define DEFAULTAUGERRAMP 200 // Auger ramp rate (RPM per rotation)
 
 /* Max Number of Stored Recipes
- * Calculated as (16-3)*2. Minus 3 since the first
- * 3 blocks are reserved for system information.
- * Each Recipe Block can store 2 recipes.
+ * Calculated from the space left between the slot data and
+ * rack state and the quantity journal. Each Recipe Block stores
+ * one recipe and takes a quarter word of the recipe directory.
  */
-#define MAXNUMRECP 26
+#define MAXNUMRECP (((JRNLADDR - RECBLKADDR) * 4 - 3) / (RECBLKSIZE * 4 + 1))
+
+/* Max Number of Dropped Recipes
+ * The 16 slot layout first filled the whole EEPROM with recipe
+ * blocks. Recipes past MAXNUMRECP sit where the recipe directory
+ * and the journal are now, so they are dropped at start-up and
+ * their names kept to be reported. See Read_DroppedRecipe
+ */
+#define MAXDROPRECP (((EEPROMSIZE - RECBLKADDR) / RECBLKSIZE) - MAXNUMRECP)
 
 // Error Codes
 #define ERROROOM 0xDEAD
@@ -63,6 +152,20 @@ typedef union
 
 }SpiceDataType;
 
+// Data Union/Structure for storing/accessing the auger
+// speed (RPM) and ramp rate (RPM per rotation) of a slot
+typedef union
+{
+	uint16_t As16BitWord;
+
+	struct
+	{
+		uint16_t speed : 8;
+		uint16_t ramp : 8;
+	}DataBits;
+
+}AugerCalibType;
+
 // Struct for storing Spice Name and Data information
 typedef struct
 {
@@ -77,6 +180,25 @@ typedef struct
 	SpiceDataType Data[MAXSLOTS];
 }RecipeStructType;
 
+// Layout of the EEPROM found at start-up. See Read_EEPROMLayout
+typedef enum
+{
+	LAYOUT_CURRENT,
+	LAYOUT_BLANK,       // Never initialized
+	LAYOUT_OLD,         // Fixed 8 slot layout, moved to the current one
+	LAYOUT_UNKNOWN      // Not recognized, replaced by the defaults
+}EEPROMLayoutEnumType;
+
+// Rack state saved across power cycles. Clean is set once
+// a rack move has completed and cleared while it is moving.
+// Hall is the hall sensor input at the saved position.
+typedef struct
+{
+	int32_t position;
+	uint16_t clean;
+	uint16_t hall;
+}RackStateStructType;
+
 /*========================================================
 * Function Definitions
 *========================================================
@@ -87,10 +209,14 @@ extern uint16_t Read_NumofRecipes(void);
 extern uint16_t Read_SpiceRemQty(uint8_t position);
 extern uint8_t *Read_SpiceName(uint8_t position);
 extern uint8_t *Read_RecipeName(uint8_t position);
+extern EEPROMLayoutEnumType Read_EEPROMLayout(void);
+extern uint8_t Read_NumDroppedRecipes(void);
+extern uint8_t *Read_DroppedRecipe(uint8_t number);
 
 // Write functions return an error code
 extern uint16_t initSpiceData(bool reset);
 extern uint16_t Write_SpiceRemQty(uint8_t position, uint16_t qty);
+extern uint16_t Flush_SpiceRemQty(void);
 extern uint16_t Write_Recipe(RecipeStructType recipe);
 extern uint16_t Write_RecipeX(RecipeStructType recipe, uint16_t number);
 extern uint16_t Write_SpiceName(uint8_t position, uint8_t *name);
@@ -99,6 +225,20 @@ extern uint16_t Update_NumRecipes(uint8_t number);
 extern uint16_t Delete_Recipe(uint8_t number);
 extern uint16_t Write_CalibVal(uint16_t type, int16_t value);
 extern int16_t Read_CalibVal(uint16_t type);
+extern uint16_t Write_DoseCalib(uint8_t position, uint16_t microsteps);
+extern uint16_t Read_DoseCalib(uint8_t position);
+extern uint16_t Write_AugerCalib(uint8_t position, AugerCalibType calib);
+extern AugerCalibType Read_AugerCalib(uint8_t position);
+extern uint16_t Write_NumofSlots(uint8_t slots);
+extern uint8_t Read_NumofSlots(void);
+extern uint16_t Write_SlotAngle(uint8_t position, uint16_t microsteps);
+extern uint16_t Read_SlotAngle(uint8_t position);
+extern uint16_t Write_RackState(RackStateStructType state);
+extern uint16_t Read_RackState(RackStateStructType* state);
+extern uint16_t Write_RackTune(uint16_t speed, uint16_t accel);
+extern uint16_t Read_RackTune(uint16_t* speed, uint16_t* accel);
+extern uint16_t Write_ServoSlew(uint16_t slew);
+extern uint16_t Read_ServoSlew(uint16_t* slew);
 extern void TestEEPROM(void);
 
 #endif /* EEPROMCONTROL_H_ */
@@ -20,7 +20,7 @@
 #include "parsing.h"
 #include "UIControl.h"
 
-#define NUMOFCMDS 11
+#define NUMOFCMDS 17
 
 // If a command is added here, don't forget to add
 // verbage to the displayHelpPage function for syntax usage.
@@ -37,6 +37,12 @@ UICmdStructType commands[NUMOFCMDS] =
     {"home",   1},
     {"reset",  1},
     {"stop",   1},
+    {"calibrate", 3},
+    {"auger",  2},
+    {"tune",   1},
+    {"slots",  1},
+    {"servo",  1},
+    {"motionstats", 1},
 };
 
 void displayHelpPage(void)
@@ -48,7 +54,9 @@ void displayHelpPage(void)
     putsUart0("spice <name> <qty>   - Dispenses the qty of a defined spice.\n");
     putsUart0("                       Note: qty is in half-teaspoon measurements.\n");
     putsUart0("\n");
-    putsUart0("recipe <name>        - Dispenses the specified recipe.\n");
+    putsUart0("recipe <name>        - Dispenses the specified recipe. The spices are\n");
+    putsUart0("                       dispensed in the order with the least rack\n");
+    putsUart0("                       travel. Add asis to keep the saved order.\n");
     putsUart0("\n");
     putsUart0("view <item>          - View a list of stored items. view Spices will \n");
     putsUart0("                       display a list of the stored spices and their \n");
@@ -67,6 +75,8 @@ void displayHelpPage(void)
     putsUart0("\n");
     putsUart0("refill <spice> <qty> - Refill a spice with a specified quantity \n");
     putsUart0("                       <spice> must be the name of an existing spice \n");
+    putsUart0("                       or a slot number. A spice held in several \n");
+    putsUart0("                       slots refills the emptiest one. \n");
     putsUart0("\n");
     putsUart0("change               - Change or Update the name of an existing spice \n");
     putsUart0("\n");
@@ -78,8 +88,34 @@ void displayHelpPage(void)
     putsUart0("                       remove all stored recipes. \n");
     putsUart0("\n");
     putsUart0("stop                 - Turns off all motors. Homing must be performed\n");
-    putsUart0("                       after this command is used to ensure correct\n");
-    putsUart0("                       home state\n");
+    putsUart0("                       after this command if the rack was stopped\n");
+    putsUart0("                       while moving\n");
+    putsUart0("\n");
+    putsUart0("calibrate <spice> <rotations>\n");
+    putsUart0("                     - Calibrates the dose of a spice. The auger is\n");
+    putsUart0("                       turned the number of rotations and the amount\n");
+    putsUart0("                       dispensed (half-teaspoons) must be entered.\n");
+    putsUart0("\n");
+    putsUart0("auger <spice> <speed> <ramp>\n");
+    putsUart0("                     - View or set the auger speed (RPM) and ramp\n");
+    putsUart0("                       rate (RPM per rotation) used for a spice.\n");
+    putsUart0("                       Leave out the ramp to keep it, or leave out\n");
+    putsUart0("                       speed and ramp to view them.\n");
+    putsUart0("\n");
+    putsUart0("tune                 - Finds the fastest speed and acceleration the\n");
+    putsUart0("                       rack can run at without losing steps and\n");
+    putsUart0("                       saves them with a safety margin.\n");
+    putsUart0("\n");
+    putsUart0("slots <count>        - View the carousel slots or change the number\n");
+    putsUart0("slots <slot> <angle>   of slots. An angle (tenths of a degree from\n");
+    putsUart0("                       home) corrects the position of one slot.\n");
+    putsUart0("\n");
+    putsUart0("servo <slew>         - View or set the servo slew rate (us per\n");
+    putsUart0("                       degree) the clutch moves are timed with.\n");
+    putsUart0("\n");
+    putsUart0("motionstats <clear>  - View the step interrupt latency and step\n");
+    putsUart0("                       period error of each motor, or clear them.\n");
+    putsUart0("                       Needs a build with MOTIONSTATS set to 1.\n");
     putsUart0("=====================================================================\n");
     putsUart0("\n");
 }
@@ -91,6 +127,7 @@ int main(void)
     StepMotorInit();
     ServoInit();
     HallSensorInit();
+    InitDispense();
 
     // Initialize UARTspi
     initUart0();
@@ -98,17 +135,27 @@ int main(void)
 
     // Initialize EEPROM and UI List
 	initEeprom();
-    initSpiceData(false);
+    initEepromData();
     initSpiceList();
     initRecipeList();
+    initDoseCalib();
+    initRackTune();
+    initSlotGeometry();
+    initServoSlew();
 
     USER_DATA data;
     int8_t code = -1;
 
-    bool homing_performed = false;
+    // The rack only needs to be homed if its saved position can't be trusted
+    bool homing_performed = RestoreRackState();
 
     while(true)
     {
+        // Idle until the next command. Write back the spice quantities
+        // and the rack position
+        Flush_SpiceRemQty();
+        FlushRackState();
+
         putsUart0("\n============================= MAIN MENU =============================\n");
         putsUart0("Enter a command (Press Enter for a list of commands): ");
         clearBuffer(&data);
@@ -164,7 +211,7 @@ int main(void)
                 break;
             case 8:
                 UIRackHome();
-                homing_performed = true;
+                homing_performed = IsRackPositionValid();
                 break;
             case 9:
                 resetSystem(&data);
@@ -173,7 +220,46 @@ int main(void)
                 putsUart0("Turning Off all Motors\n");
                 TurnOffMotor(RACK);
                 TurnOffMotor(AUGER);
-                homing_performed = false;
+                homing_performed = IsRackPositionValid();
+                break;
+            case 11:
+                if(homing_performed == false)
+                {
+                    putsUart0("====================== WARNING ======================\n");
+                    putsUart0("Homing has not been performed since the last start-up!\n");
+                    putsUart0("or emergency stop. Please home the rack using the home\n");
+                    putsUart0("command before dispensing\n");
+                }
+                else
+                {
+                    calibrate(&data);
+                }
+                break;
+            case 12:
+                augerProfile(&data);
+                break;
+            case 13:
+                if(homing_performed == false)
+                {
+                    putsUart0("====================== WARNING ======================\n");
+                    putsUart0("Homing has not been performed since the last start-up!\n");
+                    putsUart0("or emergency stop. Please home the rack using the home\n");
+                    putsUart0("command before tuning\n");
+                }
+                else
+                {
+                    autoTune(&data);
+                    homing_performed = IsRackPositionValid();
+                }
+                break;
+            case 14:
+                slotGeometry(&data);
+                break;
+            case 15:
+                servoSlew(&data);
+                break;
+            case 16:
+                motionStats(&data);
                 break;
             default:
                 putsUart0("ERROR: Command not recognized.\n");